@@ -0,0 +1,362 @@
+/*
+ * Copyright 2014+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WARP_BLOCK_HPP
+#define __WARP_BLOCK_HPP
+
+#include "warp/frozen.hpp"
+#include "warp/lz.hpp"
+#include "warp/mmap.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+#include <string.h>
+
+namespace ioremap { namespace warp {
+
+/*
+ * Block-compressed container.
+ *
+ *	header
+ *	blocks, every one is compressed independently (see lz.hpp) or stored as is if it does not compress
+ *	index: offset, sizes, codec and checksum of every block
+ *	trailer: index offset, number of blocks, total uncompressed size and magic
+ *
+ * Record streams are cut into blocks only between records, so every block can be
+ * decompressed and decoded on its own. Checksum is taken over uncompressed data.
+ */
+namespace block {
+
+static const char magic[8] = {'W', 'A', 'R', 'P', 'B', 'L', 'K', '\0'};
+
+enum {
+	serialization_version = 1,
+	default_block_size = 1024 * 1024
+};
+
+enum codec {
+	codec_stored = 0,
+	codec_lz
+};
+
+struct header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	block_size;
+};
+
+struct entry {
+	uint64_t	offset;
+	uint32_t	size;
+	uint32_t	raw_size;
+	uint32_t	codec;
+	uint32_t	checksum;
+};
+
+struct trailer {
+	uint64_t	index_offset;
+	uint64_t	blocks;
+	uint64_t	raw_size;
+	char		magic[8];
+};
+
+static inline uint32_t checksum(const char *data, size_t size)
+{
+	return hash_bytes(data, size, 0);
+}
+
+// checks magic without mapping the file, returns false if file can not be read
+static inline bool is_block_file(const std::string &path)
+{
+	char data[sizeof(header)];
+
+	std::ifstream in(path.c_str(), std::ios::binary);
+	in.read(data, sizeof(data));
+	return in.gcount() == sizeof(data) && !memcmp(data, magic, sizeof(magic));
+}
+
+} // namespace block
+
+/*
+ * Compresses data into blocks and writes them into @Writer which must provide
+ * int append(const char *, size_t) returning 0 or negative error code.
+ * All methods return the same error codes.
+ */
+template <typename Writer>
+class block_writer {
+	public:
+		block_writer(Writer &out, size_t block_size = block::default_block_size) :
+			m_out(out), m_block_size(block_size), m_offset(0), m_raw_size(0) {
+			m_block.reserve(block_size * 2);
+		}
+
+		// record is never split between blocks, block is closed after the record which fills it
+		int add(const char *data, size_t size) {
+			m_block.append(data, size);
+			if (m_block.size() < m_block_size)
+				return 0;
+
+			return flush();
+		}
+
+		// data can be split at any position
+		int append(const char *data, size_t size) {
+			while (size) {
+				size_t sz = std::min(size, m_block_size - m_block.size());
+				m_block.append(data, sz);
+				data += sz;
+				size -= sz;
+
+				if (m_block.size() == m_block_size) {
+					int err = flush();
+					if (err)
+						return err;
+				}
+			}
+
+			return 0;
+		}
+
+		// writes the last block, index and trailer
+		int finish(void) {
+			int err = flush();
+			if (!err)
+				err = start();
+			if (err)
+				return err;
+
+			block::trailer t;
+			t.index_offset = m_offset;
+			t.blocks = m_index.size();
+			t.raw_size = m_raw_size;
+			memcpy(t.magic, block::magic, sizeof(t.magic));
+
+			err = write((const char *)m_index.data(), m_index.size() * sizeof(block::entry));
+			if (!err)
+				err = write((const char *)&t, sizeof(t));
+			return err;
+		}
+
+	private:
+		Writer &m_out;
+		size_t m_block_size;
+		uint64_t m_offset;
+		uint64_t m_raw_size;
+
+		std::string m_block;
+		std::string m_compressed;
+		std::vector<block::entry> m_index;
+
+		// header is written before the first block
+		int start(void) {
+			if (m_offset)
+				return 0;
+
+			block::header h;
+			memcpy(h.magic, block::magic, sizeof(h.magic));
+			h.version = block::serialization_version;
+			h.block_size = m_block_size;
+
+			m_offset = sizeof(h);
+			return m_out.append((const char *)&h, sizeof(h));
+		}
+
+		int write(const char *data, size_t size) {
+			int err = start();
+			if (err || !size)
+				return err;
+
+			m_offset += size;
+			return m_out.append(data, size);
+		}
+
+		int flush(void) {
+			if (m_block.empty())
+				return 0;
+
+			lz::compress(m_block.data(), m_block.size(), m_compressed);
+
+			block::entry e;
+			e.raw_size = m_block.size();
+			e.checksum = block::checksum(m_block.data(), m_block.size());
+
+			const std::string *data = &m_compressed;
+			e.codec = block::codec_lz;
+			if (m_compressed.size() >= m_block.size()) {
+				data = &m_block;
+				e.codec = block::codec_stored;
+			}
+
+			int err = start();
+			if (err)
+				return err;
+
+			e.offset = m_offset;
+			e.size = data->size();
+
+			err = write(data->data(), data->size());
+			if (err)
+				return err;
+
+			m_index.push_back(e);
+			m_raw_size += m_block.size();
+			m_block.clear();
+			return 0;
+		}
+};
+
+// mapped block-compressed container, constructor throws if the file is not valid
+class block_reader {
+	public:
+		block_reader(const std::string &path) : m_file(path), m_path(path) {
+			const char *base = m_file.data();
+			const size_t size = m_file.size();
+
+			block::header h;
+			block::trailer t;
+			if (size < sizeof(h) + sizeof(t))
+				throw_error("file is too small");
+
+			memcpy(&h, base, sizeof(h));
+			memcpy(&t, base + size - sizeof(t), sizeof(t));
+			if (memcmp(h.magic, block::magic, sizeof(h.magic)) || memcmp(t.magic, block::magic, sizeof(t.magic)))
+				throw_error("invalid magic");
+			if (h.version != block::serialization_version)
+				throw_error("version mismatch");
+
+			const uint64_t data_end = size - sizeof(t);
+			if (t.index_offset > data_end || (data_end - t.index_offset) / sizeof(block::entry) != t.blocks ||
+					(data_end - t.index_offset) % sizeof(block::entry))
+				throw_error("invalid block index");
+
+			m_index.resize(t.blocks);
+			memcpy((char *)m_index.data(), base + t.index_offset, t.blocks * sizeof(block::entry));
+
+			uint64_t raw_size = 0;
+			for (auto e = m_index.begin(); e != m_index.end(); ++e) {
+				if (e->offset > t.index_offset || e->size > t.index_offset - e->offset)
+					throw_error("block is out of file bounds");
+				if (e->codec > block::codec_lz || (e->codec == block::codec_stored && e->size != e->raw_size))
+					throw_error("invalid block codec");
+
+				raw_size += e->raw_size;
+			}
+
+			if (raw_size != t.raw_size)
+				throw_error("uncompressed size mismatch");
+			m_raw_size = raw_size;
+		}
+
+		size_t size(void) const {
+			return m_index.size();
+		}
+
+		size_t raw_size(void) const {
+			return m_raw_size;
+		}
+
+		size_t raw_size(size_t idx) const {
+			return m_index[idx].raw_size;
+		}
+
+		// decompresses block @idx into @dst which must have raw_size(@idx) bytes, throws on corrupted data
+		void read(size_t idx, char *dst) const {
+			const block::entry &e = m_index[idx];
+			const char *src = m_file.data() + e.offset;
+
+			if (e.codec == block::codec_stored)
+				memcpy(dst, src, e.size);
+			else if (!lz::decompress(src, e.size, dst, e.raw_size))
+				throw_error("corrupted block data", idx);
+
+			if (block::checksum(dst, e.raw_size) != e.checksum)
+				throw_error("block checksum mismatch", idx);
+		}
+
+		void read(size_t idx, std::string &out) const {
+			out.resize(m_index[idx].raw_size);
+			read(idx, &out[0]);
+		}
+
+		// decompresses the whole file with @thread_num threads
+		std::string read_all(int thread_num) const {
+			std::string out(m_raw_size, '\0');
+
+			std::vector<size_t> offsets;
+			size_t offset = 0;
+			for (auto e = m_index.begin(); e != m_index.end(); ++e) {
+				offsets.push_back(offset);
+				offset += e->raw_size;
+			}
+
+			std::atomic_size_t next(0);
+			std::vector<std::string> errors(std::max(thread_num, 1));
+
+			auto worker = [&] (int idx) {
+				try {
+					for (size_t i = next++; i < m_index.size(); i = next++)
+						read(i, &out[offsets[i]]);
+				} catch (const std::exception &e) {
+					errors[idx] = e.what();
+					next = m_index.size();
+				}
+			};
+
+			std::vector<std::thread> pool;
+			for (int i = 0; i < std::max(thread_num, 1); ++i)
+				pool.emplace_back(worker, i);
+			for (auto th = pool.begin(); th != pool.end(); ++th)
+				th->join();
+
+			for (auto err = errors.begin(); err != errors.end(); ++err) {
+				if (!err->empty())
+					throw std::runtime_error(*err);
+			}
+
+			return out;
+		}
+
+	private:
+		mapped_file m_file;
+		std::string m_path;
+
+		std::vector<block::entry> m_index;
+		uint64_t m_raw_size;
+
+		void throw_error(const char *what) const {
+			std::ostringstream ss;
+			ss << "block_reader: '" << m_path << "': " << what;
+			throw std::runtime_error(ss.str());
+		}
+
+		void throw_error(const char *what, size_t idx) const {
+			std::ostringstream ss;
+			ss << "block_reader: '" << m_path << "': block: " << idx << ": " << what;
+			throw std::runtime_error(ss.str());
+		}
+};
+
+}} // namespace ioremap::warp
+
+#endif /* __WARP_BLOCK_HPP */
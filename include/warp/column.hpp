@@ -0,0 +1,501 @@
+/*
+ * Copyright 2014+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WARP_COLUMN_HPP
+#define __WARP_COLUMN_HPP
+
+#include "warp/feature.hpp"
+#include "warp/mmap.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <boost/utility/string_ref.hpp>
+
+namespace ioremap { namespace warp {
+
+/*
+ * Columnar dictionary file.
+ *
+ *	header
+ *	sections, every one starts at 8 byte aligned offset
+ *	footer: number of sections followed by (id, offset, size) of every section
+ *
+ * Lemmas and word forms share one deduplicated string table: concatenated string bytes
+ * and uint32 offsets of every string plus the end offset. Record @i is the i-th element of
+ * the lemma id, word id, ending length and feature columns, features take feature_words
+ * consecutive uint64 words per record. Everything is stored in native byte order,
+ * so the file is used as is after it has been mapped.
+ */
+namespace column {
+
+static const char magic[8] = {'W', 'A', 'R', 'P', 'C', 'O', 'L', '\0'};
+
+enum {
+	serialization_version = 1
+};
+
+enum section_id {
+	section_string_data = 0,
+	section_string_offsets,
+	section_lemma_id,
+	section_word_id,
+	section_ending_len,
+	section_features,
+	section_num
+};
+
+struct header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	feature_words;
+	uint64_t	records;
+	uint64_t	strings;
+	uint64_t	footer_offset;
+};
+
+struct section {
+	uint32_t	id;
+	uint32_t	reserved;
+	uint64_t	offset;
+	uint64_t	size;
+};
+
+static inline bool is_columnar(const char *data, size_t size)
+{
+	return size >= sizeof(header) && !memcmp(data, magic, sizeof(magic));
+}
+
+// checks magic without mapping the file, returns false if file can not be read
+static inline bool is_columnar_file(const std::string &path)
+{
+	char data[sizeof(header)];
+
+	std::ifstream in(path.c_str(), std::ios::binary);
+	in.read(data, sizeof(data));
+	return is_columnar(data, in.gcount());
+}
+
+} // namespace column
+
+/*
+ * Accumulates records of one file and writes them in columnar format.
+ * Only the string table is kept in memory, fixed-width columns of every record
+ * are written into a temporary file and copied into their sections by write().
+ * All methods return 0 or negative error code.
+ */
+class column_writer {
+	public:
+		enum {
+			flush_size = 1024 * 1024
+		};
+
+		column_writer() : m_records(0) {
+			m_offsets.push_back(0);
+		}
+
+		column_writer(const column_writer &) = delete;
+
+		~column_writer() {
+			if (!m_tmp_path.empty()) {
+				m_tmp.close();
+				std::remove(m_tmp_path.c_str());
+			}
+		}
+
+		// @tmp_path is created for the fixed-width columns, it is removed by destructor
+		int open(const std::string &tmp_path) {
+			m_tmp_path = tmp_path;
+			m_tmp.open(tmp_path.c_str(), std::ios::binary | std::ios::trunc);
+			if (!m_tmp)
+				return -(errno ? errno : EIO);
+
+			return 0;
+		}
+
+		int add(const parsed_word &rec) {
+			fixed_record r;
+			memset(&r, 0, sizeof(r));
+
+			int err = string_id(rec.lemma, r.lemma_id);
+			if (!err)
+				err = string_id(rec.word, r.word_id);
+			if (err)
+				return err;
+
+			r.ending_len = rec.ending_len;
+			memcpy(r.features, rec.features.w, sizeof(r.features));
+
+			m_pending.append((const char *)&r, sizeof(r));
+			m_records++;
+
+			if (m_pending.size() >= flush_size)
+				return flush();
+			return 0;
+		}
+
+		size_t size(void) const {
+			return m_records;
+		}
+
+		/*
+		 * Writes the whole file into @out which must provide int append(const char *, size_t)
+		 * returning 0 or negative error code, the same error is returned from this method.
+		 */
+		template <typename Writer>
+		int write(Writer &out) {
+			int err = flush();
+			if (err)
+				return err;
+
+			m_tmp.close();
+			if (m_tmp.fail())
+				return -EIO;
+
+			try {
+				mapped_file tmp(m_tmp_path);
+				if (tmp.size() != m_records * sizeof(fixed_record))
+					return -EIO;
+
+				return write(out, (const fixed_record *)tmp.data());
+			} catch (const std::exception &) {
+				return -EIO;
+			}
+		}
+
+	private:
+		// fixed-width columns of one record in the temporary file
+		struct fixed_record {
+			uint32_t lemma_id;
+			uint32_t word_id;
+			int32_t ending_len;
+			uint32_t reserved;
+			uint64_t features[parsed_word::feature_mask::words];
+		};
+
+		std::string m_data;
+		std::vector<uint32_t> m_offsets;
+		std::unordered_map<std::string, uint32_t> m_ids;
+
+		std::string m_tmp_path;
+		std::ofstream m_tmp;
+		std::string m_pending;
+		size_t m_records;
+
+		static uint64_t align(uint64_t size) {
+			return (size + 7) & ~7ULL;
+		}
+
+		// string offsets are 32 bit, larger string table can not be written
+		int string_id(const std::string &str, uint32_t &id) {
+			auto it = m_ids.find(str);
+			if (it != m_ids.end()) {
+				id = it->second;
+				return 0;
+			}
+
+			if (m_data.size() + str.size() > UINT32_MAX)
+				return -EOVERFLOW;
+
+			id = m_offsets.size() - 1;
+			m_ids.emplace(str, id);
+
+			m_data.append(str);
+			m_offsets.push_back(m_data.size());
+			return 0;
+		}
+
+		int flush(void) {
+			m_tmp.write(m_pending.data(), m_pending.size());
+			m_pending.clear();
+
+			if (!m_tmp)
+				return -EIO;
+			return 0;
+		}
+
+		template <typename Writer>
+		int write(Writer &out, const fixed_record *recs) const {
+			column::header h;
+			memcpy(h.magic, column::magic, sizeof(h.magic));
+			h.version = column::serialization_version;
+			h.feature_words = parsed_word::feature_mask::words;
+			h.records = m_records;
+			h.strings = m_offsets.size() - 1;
+
+			std::vector<column::section> sections(column::section_num);
+			uint64_t offset = sizeof(h);
+
+			auto place = [&] (column::section_id id, size_t size) {
+				column::section &s = sections[id];
+				s.id = id;
+				s.reserved = 0;
+				s.offset = offset;
+				s.size = size;
+				offset = align(offset + size);
+			};
+
+			place(column::section_string_data, m_data.size());
+			place(column::section_string_offsets, m_offsets.size() * sizeof(uint32_t));
+			place(column::section_lemma_id, m_records * sizeof(uint32_t));
+			place(column::section_word_id, m_records * sizeof(uint32_t));
+			place(column::section_ending_len, m_records * sizeof(int32_t));
+			place(column::section_features, m_records * sizeof(recs->features));
+			h.footer_offset = offset;
+
+			static const char padding[8] = {0};
+
+			// copies one field of every record into the section in chunks
+			std::string chunk;
+			auto column = [&] (size_t field_offset, size_t field_size) -> int {
+				for (size_t i = 0; i < m_records; ++i) {
+					chunk.append((const char *)&recs[i] + field_offset, field_size);
+
+					if (chunk.size() >= flush_size || i + 1 == m_records) {
+						int err = out.append(chunk.data(), chunk.size());
+						chunk.clear();
+						if (err)
+							return err;
+					}
+				}
+
+				return 0;
+			};
+
+			int err = out.append((const char *)&h, sizeof(h));
+			for (int i = 0; i < column::section_num && !err; ++i) {
+				switch (i) {
+				case column::section_string_data:
+					err = out.append(m_data.data(), m_data.size());
+					break;
+				case column::section_string_offsets:
+					err = out.append((const char *)m_offsets.data(), m_offsets.size() * sizeof(uint32_t));
+					break;
+				case column::section_lemma_id:
+					err = column(offsetof(fixed_record, lemma_id), sizeof(recs->lemma_id));
+					break;
+				case column::section_word_id:
+					err = column(offsetof(fixed_record, word_id), sizeof(recs->word_id));
+					break;
+				case column::section_ending_len:
+					err = column(offsetof(fixed_record, ending_len), sizeof(recs->ending_len));
+					break;
+				case column::section_features:
+					err = column(offsetof(fixed_record, features), sizeof(recs->features));
+					break;
+				}
+
+				if (!err)
+					err = out.append(padding, align(sections[i].size) - sections[i].size);
+			}
+
+			uint64_t num = sections.size();
+			if (!err)
+				err = out.append((const char *)&num, sizeof(num));
+			if (!err)
+				err = out.append((const char *)sections.data(), sections.size() * sizeof(column::section));
+
+			return err;
+		}
+};
+
+/*
+ * Read-only view of the mapped (or already loaded) columnar file, constructor throws if the file is not valid.
+ * Accessors do not copy string data, returned references are valid while reader exists.
+ */
+class column_reader {
+	public:
+		column_reader(const std::string &path) : m_file(new mapped_file(path)), m_path(path) {
+			init(m_file->data(), m_file->size());
+		}
+
+		// reads file which has already been loaded into memory, @name is used in error messages
+		column_reader(std::string &&data, const std::string &name) : m_buffer(std::move(data)), m_path(name) {
+			init(m_buffer.data(), m_buffer.size());
+		}
+
+		size_t size(void) const {
+			return m_header.records;
+		}
+
+		size_t file_size(void) const {
+			return m_size;
+		}
+
+		size_t strings_num(void) const {
+			return m_header.strings;
+		}
+
+		boost::string_ref string(uint32_t id) const {
+			return boost::string_ref(m_data + m_offsets[id], m_offsets[id + 1] - m_offsets[id]);
+		}
+
+		uint32_t lemma_id(size_t idx) const {
+			return m_lemma_id[idx];
+		}
+
+		uint32_t word_id(size_t idx) const {
+			return m_word_id[idx];
+		}
+
+		boost::string_ref lemma(size_t idx) const {
+			return string(m_lemma_id[idx]);
+		}
+
+		boost::string_ref word(size_t idx) const {
+			return string(m_word_id[idx]);
+		}
+
+		int ending_len(size_t idx) const {
+			return m_ending_len[idx];
+		}
+
+		parsed_word::feature_mask features(size_t idx) const {
+			parsed_word::feature_mask mask;
+
+			const uint64_t *w = m_features + idx * m_header.feature_words;
+			for (size_t i = 0; i < parsed_word::feature_mask::words && i < m_header.feature_words; ++i)
+				mask.w[i] = w[i];
+
+			return mask;
+		}
+
+		// strings of @rec point into the file data
+		void get(size_t idx, parsed_word_view &rec) const {
+			rec.lemma = lemma(idx);
+			rec.word = word(idx);
+			rec.features = features(idx);
+			rec.ending_len = ending_len(idx);
+		}
+
+		// fills @rec reusing its string buffers
+		void get(size_t idx, parsed_word &rec) const {
+			parsed_word_view view;
+			get(idx, view);
+			view.copy(rec);
+		}
+
+	private:
+		std::unique_ptr<mapped_file> m_file;
+		std::string m_buffer;
+		std::string m_path;
+		size_t m_size;
+
+		column::header m_header;
+		const char *m_sections[column::section_num] = {};
+		uint64_t m_sizes[column::section_num] = {};
+
+		const char *m_data;
+		const uint32_t *m_offsets;
+		const uint32_t *m_lemma_id;
+		const uint32_t *m_word_id;
+		const int32_t *m_ending_len;
+		const uint64_t *m_features;
+
+		void init(const char *base, size_t size) {
+			m_size = size;
+
+			if (!column::is_columnar(base, size))
+				throw_error("invalid magic");
+
+			memcpy(&m_header, base, sizeof(m_header));
+			if (m_header.version != column::serialization_version)
+				throw_error("version mismatch");
+
+			uint64_t num;
+			if (m_header.footer_offset > size || size - m_header.footer_offset < sizeof(num))
+				throw_error("footer is out of file bounds");
+
+			memcpy(&num, base + m_header.footer_offset, sizeof(num));
+			if (num < column::section_num ||
+					(size - m_header.footer_offset - sizeof(num)) / sizeof(column::section) < num)
+				throw_error("truncated footer");
+
+			// unknown sections written by newer versions are skipped
+			const char *footer = base + m_header.footer_offset + sizeof(num);
+			for (uint64_t i = 0; i < num; ++i) {
+				column::section s;
+				memcpy(&s, footer + i * sizeof(s), sizeof(s));
+
+				if (s.id >= column::section_num)
+					continue;
+				if (s.offset > m_header.footer_offset || s.size > m_header.footer_offset - s.offset || (s.offset & 7))
+					throw_error("section is out of file bounds");
+
+				m_sections[s.id] = base + s.offset;
+				m_sizes[s.id] = s.size;
+			}
+
+			const uint64_t records = m_header.records;
+			const uint64_t words = m_header.feature_words;
+			if (m_sizes[column::section_string_offsets] != (m_header.strings + 1) * sizeof(uint32_t) ||
+					m_sizes[column::section_lemma_id] != records * sizeof(uint32_t) ||
+					m_sizes[column::section_word_id] != records * sizeof(uint32_t) ||
+					m_sizes[column::section_ending_len] != records * sizeof(int32_t) ||
+					m_sizes[column::section_features] != records * words * sizeof(uint64_t))
+				throw_error("column size mismatch");
+
+			m_data = m_sections[column::section_string_data];
+			m_offsets = (const uint32_t *)m_sections[column::section_string_offsets];
+			m_lemma_id = (const uint32_t *)m_sections[column::section_lemma_id];
+			m_word_id = (const uint32_t *)m_sections[column::section_word_id];
+			m_ending_len = (const int32_t *)m_sections[column::section_ending_len];
+			m_features = (const uint64_t *)m_sections[column::section_features];
+
+			// non-decreasing offsets which end at the string data size keep every string inside the section
+			if (m_offsets[m_header.strings] != m_sizes[column::section_string_data])
+				throw_error("string table size mismatch");
+			for (uint64_t i = 0; i < m_header.strings; ++i) {
+				if (m_offsets[i] > m_offsets[i + 1])
+					throw_error("string offsets are not sorted");
+			}
+			for (uint64_t i = 0; i < records; ++i) {
+				if (m_lemma_id[i] >= m_header.strings || m_word_id[i] >= m_header.strings)
+					throw_error("string id is out of bounds");
+			}
+
+			// masks written with different width are accepted as long as all set bits fit
+			if (words > parsed_word::feature_mask::words) {
+				for (uint64_t i = 0; i < records; ++i) {
+					for (uint64_t w = parsed_word::feature_mask::words; w < words; ++w) {
+						if (m_features[i * words + w])
+							throw_error("feature mask does not fit");
+					}
+				}
+			}
+		}
+
+		void throw_error(const char *what) const {
+			std::ostringstream ss;
+			ss << "column_reader: '" << m_path << "': " << what;
+			throw std::runtime_error(ss.str());
+		}
+};
+
+}} // namespace ioremap::warp
+
+#endif /* __WARP_COLUMN_HPP */
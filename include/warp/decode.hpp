@@ -0,0 +1,446 @@
+/*
+ * Copyright 2014+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WARP_DECODE_HPP
+#define __WARP_DECODE_HPP
+
+#include "warp/feature.hpp"
+
+#include <sstream>
+#include <stdexcept>
+
+#include <stdint.h>
+#include <string.h>
+
+#include <boost/utility/string_ref.hpp>
+
+namespace ioremap { namespace warp {
+
+/*
+ * Minimal msgpack reader over a contiguous buffer.
+ *
+ * It knows only the types used by dictionary records and does not build object trees,
+ * strings are returned as references into the buffer. All read methods throw
+ * std::runtime_error on type mismatch or truncated data, position is not changed then.
+ */
+class msgpack_reader {
+	public:
+		msgpack_reader(const char *data, size_t size) :
+			m_begin((const unsigned char *)data), m_ptr(m_begin), m_end(m_begin + size) {}
+
+		bool empty(void) const {
+			return m_ptr == m_end;
+		}
+
+		size_t offset(void) const {
+			return m_ptr - m_begin;
+		}
+
+		size_t size(void) const {
+			return m_end - m_begin;
+		}
+
+		// current position, it can be moved with consume() by decoders which parse data themselves
+		const unsigned char *position(void) const {
+			return m_ptr;
+		}
+
+		const unsigned char *end(void) const {
+			return m_end;
+		}
+
+		void consume(const unsigned char *ptr) {
+			m_ptr = ptr;
+		}
+
+		uint32_t read_array(void) {
+			const unsigned char *p = m_ptr;
+			uint32_t size = 0;
+
+			unsigned char c = byte(p);
+			if ((c & 0xf0) == 0x90)
+				size = c & 0x0f;
+			else if (c == 0xdc)
+				size = number<uint16_t>(p);
+			else if (c == 0xdd)
+				size = number<uint32_t>(p);
+			else
+				type_error("array", c);
+
+			m_ptr = p;
+			return size;
+		}
+
+		uint64_t read_uint(void) {
+			const unsigned char *p = m_ptr;
+			int64_t v = integer(p);
+			if (v < 0 && !m_unsigned)
+				type_error("unsigned integer", *m_ptr);
+
+			m_ptr = p;
+			return v;
+		}
+
+		int64_t read_int(void) {
+			const unsigned char *p = m_ptr;
+			int64_t v = integer(p);
+			if (m_unsigned && v < 0)
+				type_error("signed integer", *m_ptr);
+
+			m_ptr = p;
+			return v;
+		}
+
+		// raw (msgpack 0.5 strings), str and bin types
+		boost::string_ref read_str(void) {
+			const unsigned char *p = m_ptr;
+			size_t size = 0;
+
+			unsigned char c = byte(p);
+			if ((c & 0xe0) == 0xa0)
+				size = c & 0x1f;
+			else if (c == 0xd9 || c == 0xc4)
+				size = number<uint8_t>(p);
+			else if (c == 0xda || c == 0xc5)
+				size = number<uint16_t>(p);
+			else if (c == 0xdb || c == 0xc6)
+				size = number<uint32_t>(p);
+			else
+				type_error("string", c);
+
+			if ((size_t)(m_end - p) < size)
+				truncated();
+
+			m_ptr = p + size;
+			return boost::string_ref((const char *)p, size);
+		}
+
+		// skips one object including all nested objects
+		void skip(void) {
+			const unsigned char *p = m_ptr;
+			skip(p, 1);
+			m_ptr = p;
+		}
+
+	private:
+		const unsigned char *m_begin;
+		const unsigned char *m_ptr;
+		const unsigned char *m_end;
+
+		// set by integer() when returned value is an unsigned 64-bit number above INT64_MAX
+		bool m_unsigned;
+
+		unsigned char byte(const unsigned char *&p) const {
+			if (p == m_end)
+				truncated();
+			return *p++;
+		}
+
+		// big-endian number of type T
+		template <typename T>
+		T number(const unsigned char *&p) const {
+			if ((size_t)(m_end - p) < sizeof(T))
+				truncated();
+
+			uint64_t v = 0;
+			for (size_t i = 0; i < sizeof(T); ++i)
+				v = (v << 8) | p[i];
+
+			p += sizeof(T);
+			return (T)v;
+		}
+
+		int64_t integer(const unsigned char *&p) {
+			m_unsigned = false;
+
+			unsigned char c = byte(p);
+			if (c < 0x80)
+				return c;
+			if (c >= 0xe0)
+				return (int8_t)c;
+
+			switch (c) {
+			case 0xcc:
+				return number<uint8_t>(p);
+			case 0xcd:
+				return number<uint16_t>(p);
+			case 0xce:
+				return number<uint32_t>(p);
+			case 0xcf: {
+				uint64_t v = number<uint64_t>(p);
+				m_unsigned = v > (uint64_t)INT64_MAX;
+				return v;
+			}
+			case 0xd0:
+				return number<int8_t>(p);
+			case 0xd1:
+				return number<int16_t>(p);
+			case 0xd2:
+				return number<int32_t>(p);
+			case 0xd3:
+				return number<int64_t>(p);
+			}
+
+			type_error("integer", c);
+			return 0;
+		}
+
+		void skip(const unsigned char *&p, uint64_t num) const {
+			while (num--) {
+				unsigned char c = byte(p);
+				uint64_t size = 0;
+				uint64_t children = 0;
+
+				if (c < 0x80 || c >= 0xe0 || c == 0xc0 || c == 0xc2 || c == 0xc3) {
+				} else if ((c & 0xe0) == 0xa0) {
+					size = c & 0x1f;
+				} else if ((c & 0xf0) == 0x90) {
+					children = c & 0x0f;
+				} else if ((c & 0xf0) == 0x80) {
+					children = (c & 0x0f) * 2;
+				} else {
+					switch (c) {
+					case 0xcc: case 0xd0: size = 1; break;
+					case 0xcd: case 0xd1: size = 2; break;
+					case 0xca: case 0xce: case 0xd2: size = 4; break;
+					case 0xcb: case 0xcf: case 0xd3: size = 8; break;
+					case 0xd4: size = 2; break;
+					case 0xd5: size = 3; break;
+					case 0xd6: size = 5; break;
+					case 0xd7: size = 9; break;
+					case 0xd8: size = 17; break;
+					case 0xc4: case 0xd9: size = number<uint8_t>(p); break;
+					case 0xc5: case 0xda: size = number<uint16_t>(p); break;
+					case 0xc6: case 0xdb: size = number<uint32_t>(p); break;
+					case 0xc7: size = number<uint8_t>(p) + 1; break;
+					case 0xc8: size = number<uint16_t>(p) + 1; break;
+					case 0xc9: size = number<uint32_t>(p) + 1; break;
+					case 0xdc: children = number<uint16_t>(p); break;
+					case 0xdd: children = number<uint32_t>(p); break;
+					case 0xde: children = number<uint16_t>(p) * 2ULL; break;
+					case 0xdf: children = number<uint32_t>(p) * 2ULL; break;
+					default:
+						type_error("object", c);
+					}
+				}
+
+				if ((uint64_t)(m_end - p) < size)
+					truncated();
+				p += size;
+
+				skip(p, children);
+			}
+		}
+
+		void type_error(const char *expected, unsigned char c) const {
+			std::ostringstream ss;
+			ss << "msgpack_reader: offset: " << offset() << ": expected " << expected <<
+				", read type byte: 0x" << std::hex << (int)c;
+			throw std::runtime_error(ss.str());
+		}
+
+		void truncated(void) const {
+			std::ostringstream ss;
+			ss << "msgpack_reader: offset: " << offset() << ": truncated data, size: " << size();
+			throw std::runtime_error(ss.str());
+		}
+};
+
+// decodes any supported version of the record, every element is checked with the generic reader methods
+static inline void decode_record_generic(msgpack_reader &reader, parsed_word_view &rec)
+{
+	uint32_t size = reader.read_array();
+	if (size < 1)
+		throw std::runtime_error("parsed_word msgpack: empty record");
+
+	uint64_t version = reader.read_uint();
+	if (version != 1 && version != 2) {
+		std::ostringstream ss;
+		ss << "parsed_word msgpack: version mismatch: read: " << version <<
+			", must be: <= " << parsed_word::serialization_version;
+		throw std::runtime_error(ss.str());
+	}
+
+	if (size != 5) {
+		std::ostringstream ss;
+		ss << "parsed_word msgpack: array size mismatch: read: " << size << ", must be: 5";
+		throw std::runtime_error(ss.str());
+	}
+
+	rec.lemma = reader.read_str();
+	rec.word = reader.read_str();
+	rec.features = parsed_word::feature_mask();
+
+	if (version == 1) {
+		rec.features.w[0] = reader.read_uint();
+	} else {
+		// masks written with different width are accepted as long as all set bits fit
+		uint32_t words = reader.read_array();
+		for (uint32_t i = 0; i < words; ++i) {
+			uint64_t w = reader.read_uint();
+
+			if (i < parsed_word::feature_mask::words) {
+				rec.features.w[i] = w;
+			} else if (w) {
+				std::ostringstream ss;
+				ss << "parsed_word msgpack: feature mask does not fit: read: " << words * 64 <<
+					" bits, supported: " << parsed_word::feature_mask::bits;
+				throw std::runtime_error(ss.str());
+			}
+		}
+	}
+
+	rec.ending_len = reader.read_int();
+}
+
+namespace fast {
+
+// big-endian unsigned number of @size bytes
+static inline uint64_t number(const unsigned char *p, int size)
+{
+	uint64_t v = 0;
+	for (int i = 0; i < size; ++i)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+static inline bool read_str(const unsigned char *&p, const unsigned char *end, boost::string_ref &out)
+{
+	if (p == end)
+		return false;
+
+	size_t size;
+	unsigned char c = *p;
+
+	if ((c & 0xe0) == 0xa0) {
+		size = c & 0x1f;
+		p += 1;
+	} else if (c == 0xda && end - p >= 3) {
+		size = number(p + 1, 2);
+		p += 3;
+	} else if (c == 0xd9 && end - p >= 2) {
+		size = p[1];
+		p += 2;
+	} else {
+		return false;
+	}
+
+	if ((size_t)(end - p) < size)
+		return false;
+
+	out = boost::string_ref((const char *)p, size);
+	p += size;
+	return true;
+}
+
+// positive fixint and uint 8/16/32/64
+static inline bool read_uint(const unsigned char *&p, const unsigned char *end, uint64_t &out)
+{
+	if (p == end)
+		return false;
+
+	unsigned char c = *p;
+	if (c < 0x80) {
+		out = c;
+		p += 1;
+		return true;
+	}
+
+	if (c < 0xcc || c > 0xcf)
+		return false;
+
+	int size = 1 << (c - 0xcc);
+	if (end - p <= size)
+		return false;
+
+	out = number(p + 1, size);
+	p += 1 + size;
+	return true;
+}
+
+// fixint only, it covers every ending length
+static inline bool read_fixint(const unsigned char *&p, const unsigned char *end, int &out)
+{
+	if (p == end)
+		return false;
+
+	unsigned char c = *p;
+	if (c < 0x80)
+		out = c;
+	else if (c >= 0xe0)
+		out = (int8_t)c;
+	else
+		return false;
+
+	p += 1;
+	return true;
+}
+
+} // namespace fast
+
+/*
+ * Decodes record of the current version with the layout written by this library: array(5), version,
+ * two strings, fixarray of exactly feature_mask::words unsigned numbers and fixint ending length.
+ * Returns false without moving the reader if data has different layout.
+ */
+static inline bool decode_record_fast(msgpack_reader &reader, parsed_word_view &rec)
+{
+	enum {
+		words = parsed_word::feature_mask::words
+	};
+
+	if (words > 15)
+		return false;
+
+	const unsigned char *p = reader.position();
+	const unsigned char *end = reader.end();
+
+	if (end - p < 2 || p[0] != 0x95 || p[1] != parsed_word::serialization_version)
+		return false;
+	p += 2;
+
+	if (!fast::read_str(p, end, rec.lemma) || !fast::read_str(p, end, rec.word))
+		return false;
+
+	if (p == end || *p != (0x90 | words))
+		return false;
+	p += 1;
+
+	for (int i = 0; i < words; ++i) {
+		if (!fast::read_uint(p, end, rec.features.w[i]))
+			return false;
+	}
+
+	if (!fast::read_fixint(p, end, rec.ending_len))
+		return false;
+
+	reader.consume(p);
+	return true;
+}
+
+/*
+ * Decodes one parsed_word record (see operator<< in pack.hpp for the layout) at the current reader position.
+ * Strings of @rec point into the reader buffer.
+ */
+static inline void decode_record(msgpack_reader &reader, parsed_word_view &rec)
+{
+	if (!decode_record_fast(reader, rec))
+		decode_record_generic(reader, rec);
+}
+
+}} // namespace ioremap::warp
+
+#endif /* __WARP_DECODE_HPP */
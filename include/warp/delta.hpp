@@ -0,0 +1,295 @@
+/*
+ * Copyright 2014+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WARP_DELTA_HPP
+#define __WARP_DELTA_HPP
+
+#include "warp/frozen.hpp"
+#include "warp/morph.hpp"
+#include "warp/pack.hpp"
+
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace ioremap { namespace warp {
+
+/*
+ * Delta file is a msgpack stream: array(2) header with "warp-delta" string and version,
+ * then array(2) of operation and parsed_word record (see operator<< in pack.hpp) for every change.
+ */
+struct delta_record {
+	enum operation {
+		remove = 0,
+		add = 1
+	};
+
+	enum {
+		serialization_version = 1
+	};
+
+	int op;
+	parsed_word rec;
+
+	delta_record() : op(add) {}
+};
+
+static const char delta_magic[] = "warp-delta";
+
+class delta_writer {
+	public:
+		delta_writer() : m_pk(m_buf) {}
+
+		// all methods return 0 or negative error code
+		int open(const std::string &path) {
+			int err = m_out.open(path);
+			if (err)
+				return err;
+
+			m_buf.data.clear();
+			m_pk.pack_array(2);
+			m_pk.pack(std::string(delta_magic));
+			m_pk.pack((int)delta_record::serialization_version);
+			return m_out.append(m_buf.data.data(), m_buf.data.size());
+		}
+
+		int add(int op, const parsed_word &rec) {
+			m_buf.data.clear();
+			m_pk.pack_array(2);
+			m_pk.pack(op);
+			m_pk.pack(rec);
+			return m_out.append(m_buf.data.data(), m_buf.data.size());
+		}
+
+		int close(void) {
+			return m_out.close();
+		}
+
+	private:
+		shard_writer m_out;
+		shard_writer::buffer m_buf;
+		msgpack::packer<shard_writer::buffer> m_pk;
+};
+
+// throws on invalid delta file
+static inline std::vector<delta_record> read_delta(const std::string &path)
+{
+	mapped_file file(path);
+	msgpack_reader reader(file.data(), file.size());
+
+	auto invalid = [&] (const char *what) {
+		std::ostringstream ss;
+		ss << "delta: '" << path << "': offset: " << reader.offset() << ": " << what;
+		throw std::runtime_error(ss.str());
+	};
+
+	if (reader.empty() || reader.read_array() != 2 || reader.read_str() != delta_magic)
+		invalid("invalid header");
+	if (reader.read_uint() != delta_record::serialization_version)
+		invalid("version mismatch");
+
+	std::vector<delta_record> ret;
+	parsed_word_view view;
+
+	while (!reader.empty()) {
+		if (reader.read_array() != 2)
+			invalid("invalid record");
+
+		delta_record d;
+		d.op = reader.read_uint();
+		if (d.op != delta_record::remove && d.op != delta_record::add)
+			invalid("unknown operation");
+
+		decode_record(reader, view);
+		view.copy(d.rec);
+
+		ret.emplace_back(std::move(d));
+	}
+
+	return ret;
+}
+
+/*
+ * Words changed by delta files on top of the frozen base index.
+ *
+ * Every word touched by a delta keeps the complete list of its records: records of the base
+ * (or of the previous overlay) minus removed ones plus added ones. Lookup of such word is answered
+ * by the overlay only, even if all its records have been removed, other words go to the base index.
+ * Overlay is immutable once built, the next delta builds a new overlay which carries all words of the previous one.
+ */
+class morph_overlay {
+	public:
+		typedef std::map<std::string, std::vector<parsed_word>> word_map;
+
+		morph_overlay(const morph_index &base, const morph_overlay *prev, const std::vector<delta_record> &delta) {
+			if (prev)
+				m_words = prev->m_words;
+
+			for (auto d = delta.begin(); d != delta.end(); ++d) {
+				auto it = m_words.find(d->rec.word);
+				if (it == m_words.end())
+					it = m_words.insert(std::make_pair(d->rec.word, base_records(base, d->rec.word))).first;
+
+				std::vector<parsed_word> &recs = it->second;
+				auto pos = std::find_if(recs.begin(), recs.end(), [&] (const parsed_word &rec) {
+						return same(rec, d->rec);
+					});
+
+				if (d->op == delta_record::add && pos == recs.end())
+					recs.push_back(d->rec);
+				else if (d->op == delta_record::remove && pos != recs.end())
+					recs.erase(pos);
+			}
+
+			build();
+		}
+
+		// keeps words of @current whose records are not the same as in @compacted, the rest is in the new base
+		morph_overlay(const morph_overlay &current, const morph_overlay &compacted) {
+			for (auto w = current.m_words.begin(); w != current.m_words.end(); ++w) {
+				auto c = compacted.m_words.find(w->first);
+				if (c == compacted.m_words.end() || !same(c->second, w->second))
+					m_words.insert(*w);
+			}
+
+			build();
+		}
+
+		// returns false if word has not been changed and the base index must be checked
+		bool lookup(const char *word, size_t size, morph_index::range &ret) const {
+			ret = m_index.lookup(word, size);
+			if (ret.first != ret.second)
+				return true;
+
+			return m_removed.find(word, size) != frozen_hash::npos;
+		}
+
+		std::string lemma(uint32_t lemma_id) const {
+			return m_index.lemma(lemma_id);
+		}
+
+		bool owns(const morph_entry *e) const {
+			return m_index.owns(e);
+		}
+
+		const word_map &words(void) const {
+			return m_words;
+		}
+
+		size_t words_num(void) const {
+			return m_words.size();
+		}
+
+	private:
+		word_map m_words;
+
+		morph_index m_index;
+		// words which have no records left
+		frozen_hash m_removed;
+
+		static bool same(const parsed_word &a, const parsed_word &b) {
+			return std::tie(a.word, a.lemma, a.features, a.ending_len) == std::tie(b.word, b.lemma, b.features, b.ending_len);
+		}
+
+		static bool same(const std::vector<parsed_word> &a, const std::vector<parsed_word> &b) {
+			return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(),
+					[] (const parsed_word &x, const parsed_word &y) { return same(x, y); });
+		}
+
+		static std::vector<parsed_word> base_records(const morph_index &base, const std::string &word) {
+			std::vector<parsed_word> ret;
+
+			morph_index::range r = base.lookup(word);
+			for (auto e = r.first; e != r.second; ++e) {
+				parsed_word rec;
+				rec.word = word;
+				rec.lemma = base.lemma(e->lemma_id);
+				rec.features = e->features;
+				rec.ending_len = e->ending_len;
+
+				ret.emplace_back(std::move(rec));
+			}
+
+			return ret;
+		}
+
+		void build(void) {
+			std::vector<std::string> removed;
+
+			m_index.prepare(1);
+			for (auto w = m_words.begin(); w != m_words.end(); ++w) {
+				if (w->second.empty())
+					removed.push_back(w->first);
+
+				for (auto rec = w->second.begin(); rec != w->second.end(); ++rec)
+					m_index.add(0, *rec);
+			}
+
+			m_index.freeze();
+			m_removed.build(removed);
+		}
+};
+
+// morphological dictionary as seen by lookups, both parts are immutable
+struct morph_snapshot {
+	std::shared_ptr<const morph_index> base;
+	std::shared_ptr<const morph_overlay> overlay;
+
+	morph_index::range lookup(const char *word, size_t size) const {
+		morph_index::range ret;
+		if (overlay && overlay->lookup(word, size, ret))
+			return ret;
+
+		return base->lookup(word, size);
+	}
+
+	// lemma of the entry returned by lookup()
+	std::string lemma(const morph_entry *e) const {
+		if (overlay && overlay->owns(e))
+			return overlay->lemma(e->lemma_id);
+
+		return base->lemma(e->lemma_id);
+	}
+
+	// base index with all overlay changes merged in
+	std::shared_ptr<const morph_index> compact(void) const {
+		std::shared_ptr<morph_index> ret = std::make_shared<morph_index>();
+		ret->prepare(1);
+
+		base->for_each([&] (const parsed_word &rec) {
+				if (!overlay || !overlay->words().count(rec.word))
+					ret->add(0, rec);
+			});
+
+		if (overlay) {
+			for (auto w = overlay->words().begin(); w != overlay->words().end(); ++w) {
+				for (auto rec = w->second.begin(); rec != w->second.end(); ++rec)
+					ret->add(0, *rec);
+			}
+		}
+
+		ret->freeze();
+		return ret;
+	}
+};
+
+}} // namespace ioremap::warp
+
+#endif /* __WARP_DELTA_HPP */
@@ -25,8 +25,14 @@
 #include <set>
 
 #include <boost/locale.hpp>
+#include <boost/utility/string_ref.hpp>
 
+#include "mask.hpp"
+#include "mmap.hpp"
+#include "queue.hpp"
+#include "tags.hpp"
 #include "timer.hpp"
+#include "tokenizer.hpp"
 
 namespace ioremap { namespace warp {
 
@@ -41,108 +47,71 @@ struct token_entity {
 	}
 };
 
+// maps grammatical tags to feature bit positions, see tags.hpp for the tag table
 struct parser {
-	std::map<std::string, token_entity> t2p;
 	int unique;
 
-	void push(const std::vector<std::string> &tokens) {
-		for (auto it = tokens.begin(); it != tokens.end(); ++it) {
-			if (insert(*it, unique))
-				++unique;
-		}
-	}
-
-	void push(const std::string &bool_token) {
-		if (insert(bool_token, unique))
-			++unique;
-	}
+	parser() : unique(tags::unique) {}
 
-	token_entity try_parse(const std::string &token) {
+	token_entity try_parse(const char *token, size_t size) const {
 		token_entity tok;
-
-		auto it = t2p.find(token);
-		if (it != t2p.end())
-			tok = it->second;
-
+		tok.position = tags::find(token, size);
 		return tok;
 	}
 
-	bool insert(const std::string &token, int position) {
-		token_entity t;
-
-		auto pos = t2p.find(token);
-		if (pos == t2p.end()) {
-			t.position = position;
-
-			t2p[token] = t;
-
-			//std::cout << token << ": " << position << std::endl;
-		}
-
-		return pos == t2p.end();
+	token_entity try_parse(const std::string &token) const {
+		return try_parse(token.data(), token.size());
 	}
+};
 
-	parser() : unique(0) {
-		push({ "им", "род", "дат", "вин", "твор", "пр" });
-		push({ std::string("ед"), "мн" });
-		push({ std::string("неод"), "од" });
-		push({ std::string("полн"), "кр" });
-		push({ "муж", "жен", "сред", "мж" });
-		push("устар");
-		push({ std::string("прич"), "деепр" });
-		push({ std::string("действ"), "страд" });
-		push({ "имя", "отч", "фам" });
-		push({ "S", "A", "V", "PART", "PR", "CONJ", "INTJ", "ADV", "PRDK", "SPRO", "COM", "APRO", "ANUM" });
-
-		token_entity ent;
-		ent = try_parse("ADV");
-		insert("ADVPRO", ent.position);
-		ent = try_parse("ANUM");
-		insert("NUM", ent.position);
-
-		push({ "наст", "прош", "буд" });
-		push({ "1", "2", "3" });
-		push({ std::string("сов"), "несов" });
-		push({ "сосл", "пов", "изъяв" });
-		push("гео");
-		push("орг");
-		push({ std::string("срав"), "прев" });
-		push("инф");
-
-		push("притяж");
-		ent = try_parse("притяж");
-		insert("AOT_притяж", ent.position);
-
-		push("жарг");
-
-		push("obsclite");
-		ent = try_parse("obsclite");
-		insert("обсц", ent.position);
-
-		push("weired");
-		ent = try_parse("weired");
-		for (auto w : { "непрош", "пе", "-", "л", "нп", "reserved", "AOT_разг", "dsbl", "сокр", "парт", "вводн", "местн",
-				"редк", "AOT_ФРАЗ", "AOT_безл", "зват", "разг", "AOT_фраз", "AOT_указат", "буфф" }) {
-			insert(w, ent.position);
-		}
-	}
+// tag table is compiled in, parser keeps no state besides it
+static inline const parser &default_parser(void)
+{
+	static const parser p;
+	return p;
+}
 
-};
+// number of bits in the feature mask, every tag known to the parser takes one bit
+#ifndef WARP_FEATURE_BITS
+#define WARP_FEATURE_BITS 128
+#endif
+
+static_assert(tags::unique <= WARP_FEATURE_BITS, "feature mask is too small for the tag table");
 
 struct parsed_word {
 	enum {
-		serialization_version = 1
+		serialization_version = 2
 	};
 
 	std::string lemma;
 	std::string word;
 
-	typedef uint64_t feature_mask;
+	typedef basic_mask<WARP_FEATURE_BITS> feature_mask;
 	feature_mask features;
 
 	int ending_len;
 
-	parsed_word() : features(0ULL), ending_len(0) {}
+	parsed_word() : ending_len(0) {}
+};
+
+// parsed_word whose strings point into external memory (mapped dictionary file)
+struct parsed_word_view {
+	boost::string_ref lemma;
+	boost::string_ref word;
+
+	parsed_word::feature_mask features;
+
+	int ending_len;
+
+	parsed_word_view() : ending_len(0) {}
+
+	// fills @rec reusing its string buffers
+	void copy(parsed_word &rec) const {
+		rec.lemma.assign(lemma.data(), lemma.size());
+		rec.word.assign(word.data(), word.size());
+		rec.features = features;
+		rec.ending_len = ending_len;
+	}
 };
 
 static inline bool default_process(const struct parsed_word &) { return false; }
@@ -151,9 +120,10 @@ class zparser {
 	public:
 		// return false if you want to stop further processing
 		typedef std::function<bool (const struct parsed_word &rec)> zparser_process;
-		zparser() : m_total(0), m_process(default_process) {
+		zparser() : m_total(0), m_validate(false), m_mismatches(0), m_process(default_process) {
 			boost::locale::generator gen;
 			m_loc = gen("en_US.UTF8");
+			m_tok = tokenizer(m_loc);
 		}
 
 		void set_process(const zparser_process &process) {
@@ -161,28 +131,95 @@ class zparser {
 		}
 
 		std::vector<std::string> split(const std::string &sentence) {
-			lb::ssegment_index wmap(lb::word, sentence.begin(), sentence.end(), m_loc);
-			wmap.rule(lb::word_any);
+			return m_tok.split(sentence);
+		}
 
-			std::vector<std::string> ret;
-			for (auto it = wmap.begin(), e = wmap.end(); it != e; ++it) {
-				ret.push_back(it->str());
+		bool parse_dict_string(const std::string &text, const std::string &lemma) {
+			parsed_word rec;
+			if (!parse_record(text.data(), text.size(), lemma, rec))
+				return true;
+
+			m_total++;
+			return m_process(rec);
+		}
+
+		/*
+		 * Byte level scanner of the dictionary line like "[кош]ка S,жен,од=им,ед".
+		 * Finds root (between the first brackets), ending (non-space bytes right after the closing bracket)
+		 * and calls @tag for every tag after the root. Words are runs of letters, digits and underscores,
+		 * apostrophe or dot between letters does not break the word. Returns false if there is no valid root.
+		 */
+		template <typename T>
+		static bool scan_dict_line(const char *text, size_t size, boost::string_ref &root, boost::string_ref &ending,
+				const T &tag) {
+			const char *end = text + size;
+
+			const char *ptr = (const char *)memchr(text, '[', size);
+			if (!ptr)
+				return false;
+
+			const char *root_start = ++ptr;
+			ptr = skip_word(ptr, end);
+
+			// something is broken, skip this line at all
+			if (ptr == root_start || ptr >= end || *ptr != ']')
+				return false;
+
+			root = boost::string_ref(root_start, ptr - root_start);
+
+			// ending check, ending starts with a word character and lasts until space
+			const char *ending_start = ++ptr;
+			if (skip_word(ptr, end) != ptr) {
+				while (ptr < end && !isspace((unsigned char)*ptr))
+					++ptr;
 			}
+			ending = boost::string_ref(ending_start, ptr - ending_start);
 
-			return ret;
+			while (ptr < end) {
+				const char *start = ptr;
+				ptr = skip_word(ptr, end);
+
+				if (ptr == start) {
+					lconvert::next_utf8(ptr, end);
+					continue;
+				}
+
+				tag(start, ptr - start);
+			}
+
+			return true;
 		}
 
-		bool parse_dict_string(const std::string &token, const std::string &lemma) {
-			//std::string token = boost::locale::to_lower(token_str, m_loc);
+		// parses single dictionary line, returns false if there is no word with known features in it
+		bool parse_record(const char *text, size_t size, const std::string &lemma, parsed_word &rec) const {
+			boost::string_ref root, ending;
+
+			bool valid = scan_dict_line(text, size, root, ending, [&] (const char *tag, size_t tag_size) {
+					token_entity ent = m_p.try_parse(tag, tag_size);
+					if (ent.position != -1 && ent.position < (int)parsed_word::feature_mask::bits)
+						rec.features.set(ent.position);
+				});
+
+			if (!valid || !rec.features.any())
+				return false;
+
+			if (!lconvert::fast_lower(root.data(), root.size(), rec.word))
+				rec.word = boost::locale::to_lower(root.data(), root.data() + root.size(), m_loc);
+
+			rec.word.append(ending.data(), ending.size());
+			rec.ending_len = ending.size();
+			rec.lemma = lemma;
+			return true;
+		}
 
-			lb::ssegment_index wmap(lb::word, token.begin(), token.end(), m_loc);
+		// the same as parse_record() but uses ICU word boundary analysis, it is much slower and is used for validation
+		bool parse_record_icu(const char *text, size_t size, const std::string &lemma, parsed_word &rec) const {
+			std::string::const_iterator begin(text), stop(text + size);
+			lb::ssegment_index wmap(lb::word, begin, stop, m_loc);
 			wmap.rule(lb::word_any | lb::word_none);
 
 			std::string root;
 			std::string ending;
-			parsed_word rec;
-
-			std::vector<std::string> failed;
 
 			for (auto it = wmap.begin(), e = wmap.end(); it != e; ++it) {
 				// skip word prefixes
@@ -229,80 +266,240 @@ class zparser {
 					continue;
 
 				token_entity ent = m_p.try_parse(it->str());
-				if (ent.position == -1) {
-					failed.push_back(it->str());
-				} else {
-					if (ent.position < (int)sizeof(parsed_word::feature_mask) * 8)
-						rec.features |= (parsed_word::feature_mask)1 << ent.position;
-				}
+				if (ent.position != -1 && ent.position < (int)parsed_word::feature_mask::bits)
+					rec.features.set(ent.position);
 			}
 
-			if (rec.features == 0ULL)
-				return true;
+			if (!rec.features.any())
+				return false;
 
 			rec.word = root + ending;
 			rec.ending_len = ending.size();
 			rec.lemma = lemma;
-			m_total++;
+			return true;
+		}
 
-			return m_process(rec);
+		// every line is parsed by both the byte scanner and ICU, differences are reported to stderr
+		void set_validate(bool validate) {
+			m_validate = validate;
+		}
+
+		long mismatches(void) const {
+			return m_mismatches;
 		}
 
-		void parse_file(const std::string &input_file) {
-			std::ifstream in(input_file.c_str());
+		/*
+		 * Dictionary file is mapped into memory and cut into chunks at record boundaries
+		 * (lines starting with '@'), chunks are parsed by @thread_num threads (zero means number of cores).
+		 * Records are passed to the process callback from the calling thread in the file order.
+		 */
+		void parse_file(const std::string &input_file, int thread_num = 0) {
+			if (thread_num <= 0)
+				thread_num = std::max(1U, std::thread::hardware_concurrency());
+
+			mapped_file file(input_file);
 
 			ioremap::warp::timer t;
 			ioremap::warp::timer total;
 
-			std::string line, lemma;
-
-			long lines = 0;
+			long lines = 0, printed_lines = 0;
 			long chunk = 100000;
 			long duration;
-			bool read_lemma = false;
+			bool stop = false;
+
+			ordered_pipeline<dict_chunk, parsed_chunk> pipeline(thread_num, thread_num * 2,
+				[this] (dict_chunk &ch) {
+					return parse_chunk(ch.first, ch.second);
+				},
+				[&] (parsed_chunk &pc) {
+					for (auto m = pc.mismatched.begin(); m != pc.mismatched.end(); ++m) {
+						if (m_mismatches++ < max_reported_mismatches)
+							std::cerr << "Dictionary line is parsed differently by ICU: " << *m << std::endl;
+					}
 
-			while (std::getline(in, line)) {
-				if (++lines % chunk == 0) {
-					duration = t.restart();
-					std::cout << "Read and parsed lines: " << lines <<
-						", total words/features found: " << m_total <<
-						", elapsed time: " << total.elapsed() << " msecs" <<
-						", speed: " << chunk * 1000 / duration << " lines/sec" <<
-						std::endl;
+					for (auto rec = pc.records.begin(); rec != pc.records.end() && !stop; ++rec) {
+						m_total++;
+						if (!m_process(*rec))
+							stop = true;
+					}
+
+					lines += pc.lines;
+					if (lines - printed_lines >= chunk) {
+						duration = t.restart();
+						std::cout << "Read and parsed lines: " << lines <<
+							", total words/features found: " << m_total <<
+							", elapsed time: " << total.elapsed() << " msecs" <<
+							", speed: " << (lines - printed_lines) * 1000 / (duration + 1) << " lines/sec" <<
+							std::endl;
+						printed_lines = lines;
+					}
+				});
+
+			const char *ptr = file.data();
+			const char *end = ptr + file.size();
+			while (ptr < end && !stop) {
+				const char *next = chunk_end(ptr, end);
+				pipeline.push(dict_chunk(ptr, next));
+				ptr = next;
+			}
+			pipeline.finish();
+
+			duration = total.elapsed();
+			std::cout << "Read and parsed " << lines << " lines, elapsed: " << duration <<
+				" msecs, speed: " << lines * 1000 / (duration + 1) << " lines/sec" << std::endl;
+
+			if (m_validate)
+				std::cout << "Validation: lines parsed differently by ICU: " << m_mismatches << std::endl;
+		}
+
+		int parser_features_num(void) const {
+			return m_p.unique;
+		}
+
+		int total_features_num(void) const {
+			return m_total;
+		}
+
+	private:
+		typedef std::pair<const char *, const char *> dict_chunk;
+
+		struct parsed_chunk {
+			std::vector<parsed_word> records;
+			std::vector<std::string> mismatched;
+			long lines;
+
+			parsed_chunk() : lines(0) {}
+		};
+
+		enum {
+			dict_chunk_size = 4 * 1024 * 1024,
+			max_reported_mismatches = 100
+		};
+
+		// letters, digits and underscore, non-ASCII punctuation and spaces which show up in dictionary lines are not
+		static bool is_word_code(unsigned int code) {
+			if (code < 0x80)
+				return isalnum(code) || code == '_';
+			if (code < 0xc0)
+				return code == 0xaa || code == 0xb5 || code == 0xba;
+			if (code == 0xd7 || code == 0xf7)
+				return false;
+			if (code >= 0x2000 && code < 0x2070)
+				return false;
+			return code != 0x3000 && code != 0xfeff;
+		}
+
+		// returns end of the word which starts at @ptr, or @ptr if it does not start with a word character
+		static const char *skip_word(const char *ptr, const char *end) {
+			unsigned int prev = 0;
+
+			while (ptr < end) {
+				const char *next = ptr;
+				unsigned int code = lconvert::next_utf8(next, end);
+
+				if (is_word_code(code)) {
+					prev = code;
+					ptr = next;
+					continue;
+				}
+
+				// the same rules as ICU word boundaries: apostrophe and dot join letters,
+				// dot, comma and semicolon join digits
+				if (prev && next < end) {
+					const char *after = next;
+					unsigned int following = lconvert::next_utf8(after, end);
+
+					bool digits = isdigit(prev) && isdigit(following);
+					bool letters = !isdigit(prev) && !isdigit(following) && is_word_code(following) &&
+						prev != '_' && following != '_';
+
+					if ((letters && (code == '\'' || code == '.')) ||
+							(digits && (code == '.' || code == ',' || code == ';'))) {
+						prev = following;
+						ptr = after;
+						continue;
+					}
 				}
 
-				if (line[0] == '@') {
+				break;
+			}
+
+			return ptr;
+		}
+
+		// chunk ends right before a line which starts with '@', or at the end of the file
+		static const char *chunk_end(const char *ptr, const char *end) {
+			if (end - ptr <= dict_chunk_size)
+				return end;
+
+			for (ptr += dict_chunk_size; ptr < end; ++ptr) {
+				ptr = (const char *)memchr(ptr, '\n', end - ptr);
+				if (!ptr || ptr + 1 >= end)
+					break;
+
+				if (ptr[1] == '@')
+					return ptr + 1;
+			}
+
+			return end;
+		}
+
+		// chunk starts at the beginning of the file or at the record boundary,
+		// so the first non-boundary line is a lemma
+		parsed_chunk parse_chunk(const char *ptr, const char *end) const {
+			parsed_chunk ret;
+
+			std::string lemma;
+			bool read_lemma = false;
+
+			while (ptr < end) {
+				const char *eol = (const char *)memchr(ptr, '\n', end - ptr);
+				if (!eol)
+					eol = end;
+
+				const char *line = ptr;
+				size_t size = eol - ptr;
+				ptr = eol + 1;
+				ret.lines++;
+
+				if (size && line[0] == '@') {
 					read_lemma = false;
 					continue;
 				}
 
 				if (!read_lemma) {
 					// next line contains lemma word
-					lemma = boost::locale::to_lower(line, m_loc);
+					if (!lconvert::fast_lower(line, size, lemma))
+						lemma = boost::locale::to_lower(line, line + size, m_loc);
 					read_lemma = true;
 					continue;
 				}
 
-				if (!parse_dict_string(line, lemma))
-					break;
-			}
-			duration = total.elapsed();
-			std::cout << "Read and parsed " << lines << " lines, elapsed: " << duration <<
-				" msecs, speed: " << lines * 1000 / duration << " lines/sec" << std::endl;
-		}
+				parsed_word rec;
+				bool found = parse_record(line, size, lemma, rec);
 
-		int parser_features_num(void) const {
-			return m_p.unique;
-		}
+				if (m_validate) {
+					parsed_word check;
+					bool check_found = parse_record_icu(line, size, lemma, check);
 
-		int total_features_num(void) const {
-			return m_total;
+					if (found != check_found || (found && (rec.word != check.word ||
+							rec.ending_len != check.ending_len || rec.features != check.features)))
+						ret.mismatched.emplace_back(line, size);
+				}
+
+				if (found)
+					ret.records.emplace_back(std::move(rec));
+			}
+
+			return ret;
 		}
 
-	private:
 		std::locale m_loc;
+		tokenizer m_tok;
 		parser m_p;
 		int m_total;
+		bool m_validate;
+		long m_mismatches;
 
 		zparser_process m_process;
 };
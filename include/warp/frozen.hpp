@@ -0,0 +1,336 @@
+/*
+ * Copyright 2014+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WARP_FROZEN_HPP
+#define __WARP_FROZEN_HPP
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <string.h>
+
+namespace ioremap { namespace warp {
+
+static inline uint64_t hash_mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static inline uint64_t hash_bytes(const char *data, size_t size, uint64_t seed)
+{
+	uint64_t h = seed ^ (size * 0x9e3779b97f4a7c15ULL);
+
+	for (; size >= 8; size -= 8, data += 8) {
+		uint64_t k;
+		memcpy(&k, data, 8);
+		h = (h ^ hash_mix(k)) * 0x9e3779b97f4a7c15ULL;
+	}
+
+	if (size) {
+		uint64_t k = 0;
+		memcpy(&k, data, size);
+		h ^= hash_mix(k);
+	}
+
+	return hash_mix(h);
+}
+
+/*
+ * Immutable string -> id table built with the hash-and-displace (CHD) scheme.
+ *
+ * Every key lands in its own slot, so a lookup is a single displacement read
+ * plus a single slot read. Slot keeps 32-bit fingerprint of the key hash, which
+ * rejects almost all misses before key bytes are touched, and key offset/size
+ * in the string pool, which is used to verify hits.
+ *
+ * All data lives in flat arrays, so the table is saved and loaded as is
+ * (native byte order).
+ */
+class frozen_hash {
+	public:
+		static const uint32_t npos = ~0U;
+		static const uint32_t max_displacement = 1 << 16;
+
+		frozen_hash() : m_size(0), m_seed(0) {}
+
+		// keys must be unique, id of the key is its position in @keys
+		void build(const std::vector<std::string> &keys) {
+			clear();
+
+			m_size = keys.size();
+			if (!m_size)
+				return;
+
+			std::vector<uint32_t> offsets;
+			offsets.reserve(m_size);
+			for (auto k = keys.begin(); k != keys.end(); ++k) {
+				offsets.push_back(m_pool.size());
+				m_pool.append(*k);
+			}
+
+			std::vector<uint64_t> hashes(m_size);
+
+			for (int attempt = 0; ; ++attempt) {
+				m_seed = hash_mix(attempt + 1);
+
+				// average bucket holds 4 keys, 1/8 of the slots are left empty
+				m_disp.assign(m_size / 4 + 1, 0);
+				size_t nslots = m_size + m_size / 8 + 1 + attempt * (m_size / 16 + 1);
+
+				for (size_t i = 0; i < m_size; ++i)
+					hashes[i] = hash_bytes(keys[i].data(), keys[i].size(), m_seed);
+
+				if (place(hashes, nslots))
+					break;
+			}
+
+			for (size_t i = 0; i < m_size; ++i) {
+				slot &s = m_slots[slot_index(hashes[i])];
+
+				s.fingerprint = (uint32_t)hashes[i];
+				s.id = i;
+				s.offset = offsets[i];
+				s.size = keys[i].size();
+			}
+		}
+
+		uint32_t find(const char *data, size_t size) const {
+			if (!m_size)
+				return npos;
+
+			uint64_t h = hash_bytes(data, size, m_seed);
+			const slot &s = m_slots[slot_index(h)];
+
+			if (s.fingerprint != (uint32_t)h || s.size != size || s.id == npos)
+				return npos;
+
+			if (memcmp(m_pool.data() + s.offset, data, size))
+				return npos;
+
+			return s.id;
+		}
+
+		uint32_t find(const std::string &key) const {
+			return find(key.data(), key.size());
+		}
+
+		size_t size(void) const {
+			return m_size;
+		}
+
+		// calls @process(id, data, size) for every key in id order
+		template <typename Process>
+		void for_each(Process process) const {
+			std::vector<const slot *> keys(m_size);
+			for (auto s = m_slots.begin(); s != m_slots.end(); ++s) {
+				if (s->id != npos)
+					keys[s->id] = &*s;
+			}
+
+			for (size_t id = 0; id < keys.size(); ++id)
+				process(id, m_pool.data() + keys[id]->offset, keys[id]->size);
+		}
+
+		void clear(void) {
+			m_size = 0;
+			m_seed = 0;
+			m_disp.clear();
+			m_slots.clear();
+			m_pool.clear();
+		}
+
+		bool save(std::ostream &out) const {
+			header h;
+			memcpy(h.magic, "WFHT", 4);
+			h.version = serialization_version;
+			h.size = m_size;
+			h.seed = m_seed;
+			h.disp_num = m_disp.size();
+			h.slot_num = m_slots.size();
+			h.pool_size = m_pool.size();
+
+			out.write((const char *)&h, sizeof(h));
+			out.write((const char *)m_disp.data(), m_disp.size() * sizeof(uint32_t));
+			out.write((const char *)m_slots.data(), m_slots.size() * sizeof(slot));
+			out.write(m_pool.data(), m_pool.size());
+
+			return out.good();
+		}
+
+		// table is checked to be consistent, lookups in the loaded table never read outside of it
+		bool load(std::istream &in) {
+			clear();
+
+			header h;
+			in.read((char *)&h, sizeof(h));
+			if (!in.good() || memcmp(h.magic, "WFHT", 4) || h.version != serialization_version ||
+					(h.size && (!h.disp_num || h.slot_num < h.size)) || h.size > npos ||
+					h.disp_num > max_load_size || h.slot_num > max_load_size || h.pool_size > max_load_size) {
+				std::cerr << "frozen_hash: invalid header" << std::endl;
+				return false;
+			}
+
+			m_disp.resize(h.disp_num);
+			m_slots.resize(h.slot_num);
+			m_pool.resize(h.pool_size);
+
+			in.read((char *)m_disp.data(), m_disp.size() * sizeof(uint32_t));
+			in.read((char *)m_slots.data(), m_slots.size() * sizeof(slot));
+			in.read(&m_pool[0], m_pool.size());
+			if (!in.good()) {
+				std::cerr << "frozen_hash: truncated data" << std::endl;
+				clear();
+				return false;
+			}
+
+			// every id has exactly one slot, key bytes of the slot are in the pool
+			std::vector<bool> seen(h.size);
+			size_t used = 0;
+			for (auto s = m_slots.begin(); s != m_slots.end(); ++s) {
+				if (s->id == npos)
+					continue;
+
+				if (s->id >= h.size || seen[s->id] || (uint64_t)s->offset + s->size > m_pool.size()) {
+					std::cerr << "frozen_hash: invalid slot" << std::endl;
+					clear();
+					return false;
+				}
+
+				seen[s->id] = true;
+				++used;
+			}
+
+			if (used != h.size) {
+				std::cerr << "frozen_hash: number of keys mismatch: slots: " << used << ", header: " << h.size << std::endl;
+				clear();
+				return false;
+			}
+
+			m_size = h.size;
+			m_seed = h.seed;
+			return true;
+		}
+
+	private:
+		enum {
+			serialization_version = 1
+		};
+
+		// sanity limit of the array sizes read from the header
+		static const uint64_t max_load_size = 1ULL << 40;
+
+		struct header {
+			char		magic[4];
+			uint32_t	version;
+			uint64_t	size;
+			uint64_t	seed;
+			uint64_t	disp_num;
+			uint64_t	slot_num;
+			uint64_t	pool_size;
+		};
+
+		struct slot {
+			uint32_t	fingerprint;
+			uint32_t	id;
+			uint32_t	offset;
+			uint32_t	size;
+
+			slot() : fingerprint(0), id(npos), offset(0), size(0) {}
+		};
+
+		size_t m_size;
+		uint64_t m_seed;
+		std::vector<uint32_t> m_disp;
+		std::vector<slot> m_slots;
+		std::string m_pool;
+
+		static uint32_t reduce(uint32_t x, size_t n) {
+			return ((uint64_t)x * n) >> 32;
+		}
+
+		static uint32_t displace(uint64_t h, uint32_t d, size_t nslots) {
+			return reduce((uint32_t)hash_mix(h + d * 0x9e3779b97f4a7c15ULL), nslots);
+		}
+
+		size_t slot_index(uint64_t h) const {
+			uint32_t d = m_disp[reduce(h >> 32, m_disp.size())];
+			return displace(h, d, m_slots.size());
+		}
+
+		bool place(const std::vector<uint64_t> &hashes, size_t nslots) {
+			std::vector<std::vector<uint32_t>> buckets(m_disp.size());
+			for (size_t i = 0; i < hashes.size(); ++i)
+				buckets[reduce(hashes[i] >> 32, buckets.size())].push_back(i);
+
+			std::vector<uint32_t> order(buckets.size());
+			for (size_t i = 0; i < order.size(); ++i)
+				order[i] = i;
+
+			// the largest buckets are the hardest to place, they go first
+			std::stable_sort(order.begin(), order.end(), [&] (uint32_t a, uint32_t b) {
+					return buckets[a].size() > buckets[b].size();
+				});
+
+			std::vector<bool> taken(nslots, false);
+			std::vector<uint32_t> pos;
+
+			for (auto b = order.begin(); b != order.end(); ++b) {
+				const std::vector<uint32_t> &bucket = buckets[*b];
+				if (bucket.empty())
+					break;
+
+				uint32_t d;
+				for (d = 0; d < max_displacement; ++d) {
+					pos.clear();
+
+					for (auto k = bucket.begin(); k != bucket.end(); ++k) {
+						uint32_t p = displace(hashes[*k], d, nslots);
+						if (taken[p] || std::find(pos.begin(), pos.end(), p) != pos.end())
+							break;
+
+						pos.push_back(p);
+					}
+
+					if (pos.size() == bucket.size())
+						break;
+				}
+
+				if (d == max_displacement)
+					return false;
+
+				for (auto p = pos.begin(); p != pos.end(); ++p)
+					taken[*p] = true;
+
+				m_disp[*b] = d;
+			}
+
+			m_slots.assign(nslots, slot());
+			return true;
+		}
+
+};
+
+}} // namespace ioremap::warp
+
+#endif /* __WARP_FROZEN_HPP */
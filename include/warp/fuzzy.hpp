@@ -23,10 +23,48 @@
 
 #include <algorithm>
 #include <mutex>
+#include <unordered_map>
 #include <vector>
 
 namespace ioremap { namespace warp {
 
+// limits amount of work spent on a single query, zero limit means there is no limit
+struct search_budget {
+	long max_candidates;
+	long max_time;
+
+	long candidates;
+	bool exceeded;
+
+	search_budget(long max_candidates = 0, long max_time = 0) :
+		max_candidates(max_candidates), max_time(max_time), candidates(0), exceeded(false) {}
+
+	// accounts @num candidates, returns false when budget is exhausted
+	bool spend(long num = 1) {
+		if (exceeded)
+			return false;
+
+		candidates += num;
+		if (max_candidates && candidates > max_candidates)
+			exceeded = true;
+
+		// clock is not read for every candidate
+		if (max_time && (candidates & ~(time_check_step - 1)) != ((candidates - num) & ~(time_check_step - 1))) {
+			if (m_timer.elapsed() >= max_time)
+				exceeded = true;
+		}
+
+		return !exceeded;
+	}
+
+	private:
+		enum {
+			time_check_step = 256
+		};
+
+		timer m_timer;
+};
+
 template <typename D>
 class fuzzy {
 	public:
@@ -36,44 +74,122 @@ class fuzzy {
 			m_ngram.load(word, d);
 		}
 
-		std::vector<D> search(const std::string &text) {
+		void freeze(void) {
+			m_ngram.freeze();
+		}
+
+		std::vector<D> search(const std::string &text) const {
 			lstring t = lconvert::from_utf8(boost::locale::to_lower(text, __fuzzy_locale));
 			return search(t);
 		}
 
-		std::vector<D> search(const lstring &text) {
+		std::vector<D> search(const lstring &text) const {
+			search_budget budget;
+			return search(text, budget);
+		}
+
+		// candidate generation stops when @budget is exhausted, candidates found so far are returned
+		std::vector<D> search(const lstring &text, search_budget &budget) const {
+			return search(text, -1, budget);
+		}
+
+		/*
+		 * Returns data which can be within @max_distance edits from @text, negative @max_distance
+		 * returns everything which shares at least one n-gram with @text.
+		 *
+		 * Every edit destroys at most n grams, so a match has to share at least
+		 * required = distinct_grams - max_distance * n grams with the text. Grams are ordered
+		 * by ascending frequency and candidates are generated only from the rarest
+		 * distinct_grams - required + 1 of them (prefix filtering), the rest of the grams
+		 * are probed in their posting lists for already known candidates only.
+		 * This way the longest posting lists are not walked at all.
+		 */
+		std::vector<D> search(const lstring &text, int max_distance, search_budget &budget) const {
 			timer tm, total;
 
 			auto ngrams = ngram::ngram<lstring, D>::split(text, m_ngram.n());
+			std::sort(ngrams.begin(), ngrams.end());
+			ngrams.erase(std::unique(ngrams.begin(), ngrams.end()), ngrams.end());
 
-			std::map<D, int> word_count;
+			typedef decltype(m_ngram.meta(text)) meta_ptr;
 
-			for (auto it = ngrams.begin(); it != ngrams.end(); ++it) {
-				auto tmp = m_ngram.lookup_word(*it);
+			std::vector<meta_ptr> metas;
+			metas.reserve(ngrams.size());
+			for (auto it = ngrams.begin(); it != ngrams.end(); ++it)
+				metas.push_back(m_ngram.meta(*it));
 
-				for (auto ndata = tmp.begin(); ndata != tmp.end(); ++ndata) {
+			// unknown grams have no postings, they are the cheapest and go first
+			std::stable_sort(metas.begin(), metas.end(), [] (meta_ptr a, meta_ptr b) {
+					return (a ? a->count : 0) < (b ? b->count : 0);
+				});
 
-					auto wc = word_count.find(ndata->data);
-					if (wc == word_count.end()) {
-						word_count[ndata->data] = 1;
-					} else {
-						wc->second++;
-					}
+			int grams = metas.size();
+			int required = 1;
+			if (max_distance >= 0 && m_ngram.frozen())
+				required = std::max(1, grams - max_distance * m_ngram.n());
+
+			int prefix = grams - required + 1;
+
+			std::unordered_map<size_t, int> word_count;
+
+			for (int i = 0; i < prefix && budget.spend(); ++i) {
+				if (!metas[i])
+					continue;
+
+				const auto &data = metas[i]->data;
+				for (auto ndata = data.begin(); ndata != data.end(); ++ndata) {
+					if (!budget.spend())
+						break;
+
+					word_count[ndata->data_index]++;
 				}
 			}
 
 			long lookup_time = tm.restart();
 
+			for (int i = prefix; i < grams && !budget.exceeded; ++i) {
+				const auto *meta = metas[i];
+
+				for (auto wc = word_count.begin(); wc != word_count.end();) {
+					// even if all remaining grams match, this word can not reach required overlap
+					if (wc->second + grams - i < required) {
+						wc = word_count.erase(wc);
+						continue;
+					}
+
+					if (!budget.spend())
+						break;
+
+					if (meta) {
+						auto pos = std::lower_bound(meta->data.begin(), meta->data.end(), wc->first,
+							[] (const decltype(meta->data[0]) &nd, size_t index) {
+								return nd.data_index < index;
+							});
+						if (pos != meta->data.end() && pos->data_index == wc->first)
+							wc->second++;
+					}
+
+					++wc;
+				}
+			}
+
 			std::vector<D> counts;
 
 			for (auto wc = word_count.begin(); wc != word_count.end(); ++wc) {
-				counts.emplace_back(wc->first);
+				if (wc->second >= required || budget.exceeded)
+					counts.emplace_back(m_ngram.data(wc->first));
 			}
 
 			long count_time = tm.restart();
 
-			std::cout << text << ": counts: " << counts.size() << ", lookup: " << lookup_time <<
+#ifdef WARP_STDOUT_DEBUG
+			std::cout << text << ": grams: " << grams << ", required: " << required << ", prefix: " << prefix <<
+				", counts: " << counts.size() << ", lookup: " << lookup_time <<
 				" ms, count: " << count_time << " ms, total: " << total.elapsed() << " ms" << std::endl;
+#else
+			(void) lookup_time;
+			(void) count_time;
+#endif
 
 			return counts;
 		}
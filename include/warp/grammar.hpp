@@ -0,0 +1,371 @@
+/*
+ * Copyright 2014+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WARP_GRAMMAR_HPP
+#define __WARP_GRAMMAR_HPP
+
+#include "warp/feature.hpp"
+#include "warp/frozen.hpp"
+
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace ioremap { namespace warp {
+
+struct ef {
+	parsed_word::feature_mask	features;
+	int				ending_len;
+
+	bool operator==(const struct ef &ef) {
+		return features == ef.features;
+	}
+	bool operator<(const struct ef &ef) const {
+		return features < ef.features;
+	}
+
+	ef() : ending_len(0) {}
+};
+
+struct word_features {
+	std::string word;
+	std::vector<ef> fvec;
+
+	word_features(const std::string &word, const std::vector<ef> &fvec) : word(word), fvec(fvec) {}
+};
+
+struct grammar {
+	parsed_word::feature_mask	features;
+	parsed_word::feature_mask	negative;
+
+	bool operator==(const grammar &other) const {
+		return features == other.features && negative == other.negative;
+	}
+};
+
+static inline int bits_set(const parsed_word::feature_mask &tmp)
+{
+	return tmp.count();
+}
+
+static inline unsigned int feature_match(const grammar &mask, const parsed_word::feature_mask &features)
+{
+	return mask_match(features, mask.features, mask.negative);
+}
+
+/*
+ * Returns the first entry which has all features requested by @mask and none of its negative features,
+ * or @end if there is no such entry, @required is the number of bits set in @mask.features.
+ * @It must be a random access iterator pointing to something with 'features' field.
+ *
+ * Entry with the largest number of requested features is only interesting when it has all of them,
+ * so instead of counting bits in every entry, entries are tested for the full match in blocks of 4,
+ * every block is reduced into a bitmap without branches.
+ */
+template <typename It>
+static inline It found(const grammar &mask, int required, It begin, It end)
+{
+	// grammar element without features never matches
+	if (!required)
+		return end;
+
+	for (; end - begin >= 4; begin += 4) {
+		unsigned int hit = feature_match(mask, begin[0].features) |
+			(feature_match(mask, begin[1].features) << 1) |
+			(feature_match(mask, begin[2].features) << 2) |
+			(feature_match(mask, begin[3].features) << 3);
+
+		if (hit)
+			return begin + __builtin_ctz(hit);
+	}
+
+	for (; begin != end; ++begin) {
+		if (feature_match(mask, begin->features))
+			return begin;
+	}
+
+	return end;
+}
+
+template <typename It>
+static inline It found(const grammar &mask, It begin, It end)
+{
+	return found(mask, bits_set(mask.features), begin, end);
+}
+
+/*
+ * Multiple grammars compiled into a single bit-parallel (shift-and) automaton.
+ *
+ * Every grammar element occupies one bit in a 64-bit lane, grammars are packed
+ * into lanes without crossing lane boundaries. Distinct grammar elements are
+ * evaluated once per token, their bit masks are OR-ed into the token mask,
+ * and all grammars advance with a shift and an AND per lane, so the whole set
+ * of grammars is matched in one linear pass over the tokens.
+ *
+ * Like the original substring search, matches of the same grammar do not overlap:
+ * once a grammar is matched, its state is reset.
+ */
+class grammar_matcher {
+	public:
+		enum {
+			max_grammar_size = 64
+		};
+
+		grammar_matcher() : m_free_bit(64) {}
+
+		// returns id of the added grammar, ids are sequential starting from 0
+		int add(const std::vector<grammar> &gram) {
+			if (gram.size() > max_grammar_size)
+				throw std::runtime_error("grammar_matcher: grammar is too long");
+
+			int id = m_sizes.size();
+			m_sizes.push_back(gram.size());
+
+			if (gram.empty())
+				return id;
+
+			if (m_free_bit + gram.size() > 64) {
+				m_start.push_back(0);
+				m_final.push_back(0);
+				m_final_ids.push_back(std::vector<int>(64, -1));
+				for (auto p = m_predicates.begin(); p != m_predicates.end(); ++p)
+					p->lanes.push_back(0);
+
+				m_free_bit = 0;
+			}
+
+			size_t lane = m_start.size() - 1;
+			int bit = m_free_bit;
+
+			m_start[lane] |= 1ULL << bit;
+			m_final[lane] |= 1ULL << (bit + gram.size() - 1);
+			m_final_ids[lane][bit + gram.size() - 1] = id;
+			m_placement.push_back(std::make_pair(lane, bit));
+
+			for (size_t i = 0; i < gram.size(); ++i)
+				predicate(gram[i]).lanes[lane] |= 1ULL << (bit + i);
+
+			m_free_bit += gram.size();
+			return id;
+		}
+
+		size_t size(void) const {
+			return m_sizes.size();
+		}
+
+		/*
+		 * Runs all grammars over @num tokens, @features(i) returns [begin, end) pair
+		 * of the entries of the i'th token. Returns start positions of the matches
+		 * for every grammar id.
+		 */
+		template <typename F>
+		std::vector<std::vector<int>> match(size_t num, const F &features) const {
+			std::vector<std::vector<int>> ret(m_sizes.size());
+			std::vector<uint64_t> state(m_start.size(), 0);
+			std::vector<uint64_t> tmask(m_start.size());
+
+			for (size_t i = 0; i < num; ++i) {
+				auto fr = features(i);
+
+				std::fill(tmask.begin(), tmask.end(), 0);
+				for (auto p = m_predicates.begin(); p != m_predicates.end(); ++p) {
+					if (found(p->gram, p->required, fr.first, fr.second) == fr.second)
+						continue;
+
+					for (size_t lane = 0; lane < tmask.size(); ++lane)
+						tmask[lane] |= p->lanes[lane];
+				}
+
+				for (size_t lane = 0; lane < state.size(); ++lane) {
+					uint64_t st = ((state[lane] << 1) | m_start[lane]) & tmask[lane];
+					uint64_t fin = st & m_final[lane];
+
+					while (fin) {
+						int bit = __builtin_ctzll(fin);
+						fin &= fin - 1;
+
+						int id = m_final_ids[lane][bit];
+						int size = m_sizes[id];
+						ret[id].push_back(i + 1 - size);
+
+						// clear state of the matched grammar, its matches do not overlap
+						st &= ~(((size == 64) ? ~0ULL : ((1ULL << size) - 1)) << m_placement[id].second);
+					}
+
+					state[lane] = st;
+				}
+			}
+
+			return ret;
+		}
+
+		std::vector<std::vector<int>> match(const std::vector<word_features> &wfeat) const {
+			return match(wfeat.size(), [&] (size_t i) {
+					const std::vector<ef> &fvec = wfeat[i].fvec;
+					return std::make_pair(fvec.data(), fvec.data() + fvec.size());
+				});
+		}
+
+	private:
+		struct grammar_predicate {
+			grammar gram;
+			int required;
+			std::vector<uint64_t> lanes;
+		};
+
+		int m_free_bit;
+
+		std::vector<int> m_sizes;
+		// lane and first bit of every grammar
+		std::vector<std::pair<size_t, int>> m_placement;
+
+		std::vector<uint64_t> m_start, m_final;
+		std::vector<std::vector<int>> m_final_ids;
+
+		std::vector<grammar_predicate> m_predicates;
+
+		grammar_predicate &predicate(const grammar &gram) {
+			for (auto p = m_predicates.begin(); p != m_predicates.end(); ++p) {
+				if (p->gram == gram)
+					return *p;
+			}
+
+			grammar_predicate p;
+			p.gram = gram;
+			p.required = bits_set(gram.features);
+			p.lanes.resize(m_start.size(), 0);
+
+			m_predicates.push_back(p);
+			return m_predicates.back();
+		}
+};
+
+/*
+ * Parses single grammar element like "S,им" or "V,-прош".
+ * Tags are separated by ASCII punctuation or spaces (underscore is a part of the tag),
+ * tags which follow '-' are negative. Unknown tags are ignored.
+ */
+static inline grammar parse_grammar(const char *ptr, size_t size, const parser &p = default_parser())
+{
+	grammar ret;
+	bool negative = false;
+
+	const char *end = ptr + size;
+	while (ptr < end) {
+		unsigned char c = *ptr;
+		if (c < 0x80 && !isalnum(c) && c != '_') {
+			if (c == '-')
+				negative = true;
+			++ptr;
+			continue;
+		}
+
+		const char *start = ptr;
+		while (ptr < end && ((unsigned char)*ptr >= 0x80 || isalnum((unsigned char)*ptr) || *ptr == '_'))
+			++ptr;
+
+		token_entity ent = p.try_parse(start, ptr - start);
+		if (ent.position != -1 && ent.position < (int)parsed_word::feature_mask::bits) {
+			if (negative)
+				ret.negative.set(ent.position);
+			else
+				ret.features.set(ent.position);
+		}
+	}
+
+	return ret;
+}
+
+// parses space separated sequence of grammar elements like "S,им V,прош S,мн"
+static inline std::vector<grammar> parse_grammars(const std::string &src, const parser &p = default_parser())
+{
+	std::vector<grammar> ret;
+
+	const char *ptr = src.data();
+	const char *end = ptr + src.size();
+	while (ptr < end) {
+		if (isspace((unsigned char)*ptr)) {
+			++ptr;
+			continue;
+		}
+
+		const char *start = ptr;
+		while (ptr < end && !isspace((unsigned char)*ptr))
+			++ptr;
+
+		ret.push_back(parse_grammar(start, ptr - start, p));
+	}
+
+	return ret;
+}
+
+struct compiled_grammar {
+	std::vector<grammar> grams;
+	grammar_matcher matcher;
+};
+
+typedef std::shared_ptr<const compiled_grammar> shared_grammar;
+
+/*
+ * Compiled grammars indexed by their source string.
+ * Cache is split into shards with their own locks, grammar is compiled outside of the lock.
+ * When shard reaches its limit it is dropped, so random grammars can not grow it without bound.
+ */
+class grammar_cache {
+	public:
+		grammar_cache(size_t limit = 4096) : m_shard_limit(limit / shard_num + 1) {}
+
+		shared_grammar get(const std::string &src) {
+			shard &sh = m_shards[hash_bytes(src.data(), src.size(), 0) % shard_num];
+
+			{
+				std::lock_guard<std::mutex> guard(sh.lock);
+				auto it = sh.grammars.find(src);
+				if (it != sh.grammars.end())
+					return it->second;
+			}
+
+			std::shared_ptr<compiled_grammar> g = std::make_shared<compiled_grammar>();
+			g->grams = parse_grammars(src);
+			g->matcher.add(g->grams);
+
+			std::lock_guard<std::mutex> guard(sh.lock);
+			if (sh.grammars.size() >= m_shard_limit)
+				sh.grammars.clear();
+
+			return sh.grammars.insert(std::make_pair(src, g)).first->second;
+		}
+
+	private:
+		enum {
+			shard_num = 16
+		};
+
+		struct shard {
+			std::mutex lock;
+			std::unordered_map<std::string, shared_grammar> grammars;
+		};
+
+		size_t m_shard_limit;
+		shard m_shards[shard_num];
+};
+
+}} // namespace ioremap::warp
+
+#endif /* __WARP_GRAMMAR_HPP */
@@ -0,0 +1,245 @@
+/*
+ * Copyright 2014+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WARP_GUESS_HPP
+#define __WARP_GUESS_HPP
+
+#include "warp/feature.hpp"
+#include "warp/frozen.hpp"
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace ioremap { namespace warp {
+
+struct morph_guess {
+	std::string			lemma;
+	parsed_word::feature_mask	features;
+	// number of dictionary forms which support this guess
+	uint32_t			count;
+	// letters of the word suffix the guess is based on
+	int				suffix;
+};
+
+/*
+ * Morphology guesser for out-of-vocabulary words.
+ *
+ * For every dictionary form and every its suffix of 1 to max_suffix letters which covers the
+ * changing tail of the form (part which differs from the lemma), the guesser counts rules
+ * (form tail -> lemma tail, features). Unknown word is analyzed by its longest suffix seen in
+ * the dictionary: its most frequent rules replace the form tail with the lemma tail.
+ *
+ * Frozen suffixes live in a perfect hash table, so a guess costs at most max_suffix hash
+ * lookups, which is equivalent to walking a reversed suffix trie.
+ */
+class suffix_guesser {
+	public:
+		enum {
+			max_suffix = 5,		// letters
+			min_suffix = 2,		// shortest suffix used for guessing
+			min_count = 2,		// suffixes seen less times are dropped
+			max_rules = 8,		// most frequent rules kept per suffix
+		};
+
+		suffix_guesser() {}
+
+		// must be called before records are added, @thread_num is the number of threads which will call add()
+		void prepare(int thread_num) {
+			m_pending.clear();
+			m_pending.resize(thread_num);
+		}
+
+		bool add(int idx, const parsed_word &rec) {
+			const std::string &word = rec.word;
+			const std::string &lemma = rec.lemma;
+
+			size_t common = 0;
+			while (common < word.size() && common < lemma.size() && word[common] == lemma[common])
+				++common;
+
+			// do not split UTF-8 sequence
+			while (common > 0 && (word[common] & 0xc0) == 0x80)
+				--common;
+
+			size_t tail = word.size() - common;
+
+			std::string rule;
+			rule.reserve(sizeof(uint32_t) + sizeof(parsed_word::feature_mask) + lemma.size() - common);
+			uint32_t tail32 = tail;
+			rule.append((const char *)&tail32, sizeof(tail32));
+			rule.append((const char *)&rec.features, sizeof(rec.features));
+			rule.append(lemma, common, std::string::npos);
+
+			auto &suffixes = m_pending[idx];
+
+			size_t pos = word.size();
+			for (int letters = 1; letters <= max_suffix && pos > 0; ++letters) {
+				pos = prev_letter(word, pos);
+
+				if (word.size() - pos < tail)
+					continue;
+
+				suffixes[word.substr(pos)][rule]++;
+			}
+
+			return true;
+		}
+
+		void freeze(void) {
+			if (m_pending.empty())
+				return;
+
+			auto &all = m_pending[0];
+			for (size_t i = 1; i < m_pending.size(); ++i) {
+				for (auto s = m_pending[i].begin(); s != m_pending[i].end(); ++s) {
+					auto &rules = all[s->first];
+					for (auto r = s->second.begin(); r != s->second.end(); ++r)
+						rules[r->first] += r->second;
+				}
+
+				pending_suffixes().swap(m_pending[i]);
+			}
+
+			std::vector<std::string> suffixes;
+			m_offsets.clear();
+			m_rules.clear();
+			m_lemma_tails.clear();
+
+			std::vector<std::pair<uint32_t, const std::string *>> rules;
+			for (auto s = all.begin(); s != all.end(); ++s) {
+				rules.clear();
+
+				uint32_t total = 0;
+				for (auto r = s->second.begin(); r != s->second.end(); ++r) {
+					rules.emplace_back(r->second, &r->first);
+					total += r->second;
+				}
+
+				if (total < min_count)
+					continue;
+
+				std::sort(rules.begin(), rules.end(), [] (const std::pair<uint32_t, const std::string *> &a,
+							const std::pair<uint32_t, const std::string *> &b) {
+						if (a.first != b.first)
+							return a.first > b.first;
+						return *a.second < *b.second;
+					});
+				if (rules.size() > max_rules)
+					rules.resize(max_rules);
+
+				suffixes.push_back(s->first);
+				m_offsets.push_back(m_rules.size());
+
+				for (auto r = rules.begin(); r != rules.end(); ++r) {
+					const std::string &key = *r->second;
+
+					guess_rule gr;
+					memcpy(&gr.form_tail, key.data(), sizeof(gr.form_tail));
+					memcpy(&gr.features, key.data() + sizeof(gr.form_tail), sizeof(gr.features));
+					gr.lemma_tail_offset = m_lemma_tails.size();
+					gr.lemma_tail_size = key.size() - sizeof(gr.form_tail) - sizeof(gr.features);
+					gr.count = r->first;
+
+					m_lemma_tails.append(key, sizeof(gr.form_tail) + sizeof(gr.features), std::string::npos);
+					m_rules.push_back(gr);
+				}
+			}
+			m_offsets.push_back(m_rules.size());
+
+			std::vector<pending_suffixes>().swap(m_pending);
+
+			m_suffixes.build(suffixes);
+		}
+
+		// @word must be lowercased, guesses are sorted by descending count
+		std::vector<morph_guess> lookup(const std::string &word) const {
+			std::vector<morph_guess> ret;
+
+			// find longest known suffix which leaves at least one letter of the stem
+			std::vector<size_t> starts;
+			size_t pos = word.size();
+			for (int letters = 1; letters <= max_suffix + 1 && pos > 0; ++letters) {
+				pos = prev_letter(word, pos);
+				starts.push_back(pos);
+			}
+
+			for (int letters = std::min<int>(max_suffix, starts.size() - 1); letters >= min_suffix; --letters) {
+				size_t start = starts[letters - 1];
+
+				uint32_t id = m_suffixes.find(word.data() + start, word.size() - start);
+				if (id == frozen_hash::npos)
+					continue;
+
+				for (uint32_t i = m_offsets[id]; i < m_offsets[id + 1]; ++i) {
+					const guess_rule &gr = m_rules[i];
+					if (gr.form_tail >= word.size())
+						continue;
+
+					morph_guess g;
+					g.lemma.reserve(word.size() - gr.form_tail + gr.lemma_tail_size);
+					g.lemma.assign(word, 0, word.size() - gr.form_tail);
+					g.lemma.append(m_lemma_tails, gr.lemma_tail_offset, gr.lemma_tail_size);
+					g.features = gr.features;
+					g.count = gr.count;
+					g.suffix = letters;
+
+					ret.emplace_back(std::move(g));
+				}
+
+				if (ret.size())
+					break;
+			}
+
+			return ret;
+		}
+
+		size_t suffixes_num(void) const {
+			return m_suffixes.size();
+		}
+
+	private:
+		typedef std::unordered_map<std::string, std::unordered_map<std::string, uint32_t>> pending_suffixes;
+		std::vector<pending_suffixes> m_pending;
+
+		struct guess_rule {
+			uint32_t			form_tail;	// bytes
+			parsed_word::feature_mask	features;
+			uint32_t			lemma_tail_offset;
+			uint32_t			lemma_tail_size;
+			uint32_t			count;
+		};
+
+		frozen_hash m_suffixes;
+		// rules of the suffix with id @i are [m_offsets[i], m_offsets[i + 1])
+		std::vector<uint32_t> m_offsets;
+		std::vector<guess_rule> m_rules;
+		std::string m_lemma_tails;
+
+		// returns position of the UTF-8 letter which ends at @pos
+		static size_t prev_letter(const std::string &word, size_t pos) {
+			do {
+				--pos;
+			} while (pos > 0 && (word[pos] & 0xc0) == 0x80);
+
+			return pos;
+		}
+};
+
+}} // namespace ioremap::warp
+
+#endif /* __WARP_GUESS_HPP */
@@ -17,161 +17,269 @@
 #ifndef __IOREMAP_WARP_LEX_HPP
 #define __IOREMAP_WARP_LEX_HPP
 
+#include "warp/delta.hpp"
+#include "warp/grammar.hpp"
+#include "warp/guess.hpp"
+#include "warp/mmap.hpp"
+#include "warp/morph.hpp"
+#include "warp/queue.hpp"
 #include "warp/spell.hpp"
+#include "warp/tokenizer.hpp"
 
 #include <boost/locale.hpp>
-#include <boost/algorithm/string.hpp>
+#include <boost/utility/string_ref.hpp>
+
+#include <condition_variable>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace lb = boost::locale::boundary;
 
 namespace ioremap { namespace warp {
 
-struct ef {
-	parsed_word::feature_mask	features;
-	int				ending_len;
+struct analyze_options {
+	// find dictionary features of every token
+	bool lookup;
 
-	bool operator==(const struct ef &ef) {
-		return features == ef.features;
-	}
-	bool operator<(const struct ef &ef) const {
-		return features < ef.features;
-	}
+	// find root (lemma) of every token
+	bool normalize;
+
+	// match this grammar over the tokens
+	shared_grammar gram;
+
+	analyze_options() : lookup(true), normalize(false) {}
+};
+
+struct analyzed_token {
+	// token bytes in analysis::text
+	uint32_t offset, size;
+
+	// root bytes in analysis::arena, set when normalization was requested
+	uint32_t root_offset, root_size;
+
+	// search budget has been exhausted while looking for the root, it is the best candidate found before that
+	bool partial;
 
-	ef() : features(0ULL), ending_len(0) {}
+	morph_index::range features;
+
+	analyzed_token() : offset(0), size(0), root_offset(0), root_size(0), partial(false), features(NULL, NULL) {}
 };
 
-struct word_features {
-	std::string word;
-	std::vector<ef> fvec;
+/*
+ * Result of the single pass over the text: text is tokenized once,
+ * tokens refer to the text and to the arena holding normalized roots.
+ */
+struct analysis {
+	std::string text;
+	std::string arena;
+	std::vector<analyzed_token> tokens;
+
+	// start positions (token indexes) of the grammar matches
+	std::vector<int> grammar_starts;
+
+	// dictionary which token features point into, it is kept alive while analysis exists
+	std::shared_ptr<const morph_snapshot> dict;
 
-	word_features(const std::string &word, const std::vector<ef> &fvec) : word(word), fvec(fvec) {}
+	boost::string_ref word(size_t idx) const {
+		return boost::string_ref(text.data() + tokens[idx].offset, tokens[idx].size);
+	}
+
+	boost::string_ref root(size_t idx) const {
+		return boost::string_ref(arena.data() + tokens[idx].root_offset, tokens[idx].root_size);
+	}
 };
 
-struct grammar {
-	parsed_word::feature_mask	features;
-	parsed_word::feature_mask	negative;
+typedef std::function<void (const analysis &)> analysis_process;
+
+struct stream_options {
+	// approximate size of the text analyzed at once
+	size_t chunk_size;
+
+	// number of worker threads, zero means number of cores
+	int thread_num;
 
-	grammar() : features(0ULL), negative(0ULL) {}
+	stream_options() : chunk_size(1024 * 1024), thread_num(0) {}
 };
 
 class lex {
 	public:
-		lex() {
+		enum {
+			// overlay with this many changed words is merged into the base index in background
+			default_compact_threshold = 10000,
+
+			// suffix guess is trusted only if it is based on a suffix of at least this many letters
+			// seen in at least this many dictionary forms, short suffixes match almost any word
+			guess_min_suffix = 3,
+			guess_min_count = 8,
+		};
+
+		lex() : m_max_candidates(0), m_max_time(0), m_compact_threshold(default_compact_threshold), m_compacting(false) {
 			boost::locale::generator gen;
 			m_loc = gen("en_US.UTF8");
+			m_tok = tokenizer(m_loc);
+			publish(empty_dict());
+		}
+
+		lex(const std::locale &loc) : m_loc(loc), m_tok(loc), m_max_candidates(0), m_max_time(0),
+			m_compact_threshold(default_compact_threshold), m_compacting(false) {
+			publish(empty_dict());
+		}
+
+		~lex() {
+			if (m_compaction.joinable())
+				m_compaction.join();
 		}
 
-		lex(const std::locale &loc) : m_loc(loc) {}
+		// limits fuzzy search work done for every word passed to root(), zero means no limit
+		void set_search_budget(long max_candidates, long max_time) {
+			m_max_candidates = max_candidates;
+			m_max_time = max_time;
+		}
 
 		void load(int ngram, const std::vector<std::string> &path) {
-			m_spell.reset(new spell(ngram));
-			m_spell->feed_dict(path);
+			load(ngram, path, std::string());
 		}
 
-		std::vector<grammar> generate(const std::vector<std::string> &grams) {
-			std::vector<grammar> ret;
+		/*
+		 * Same as above, but the morph index is read from @index file if it has been saved there
+		 * for the same dictionary files (paths, sizes and modification times), otherwise it is built
+		 * from the dictionaries and saved into @index. Spell checker and suffix guesser are always
+		 * built from the dictionaries. Returns true if the index has been read from @index,
+		 * throws if the built index could not be saved (the dictionary is loaded anyway).
+		 */
+		bool load(int ngram, const std::vector<std::string> &path, const std::string &index) {
+			wait_compaction();
 
-			parser p;
+			m_spell.reset(new spell(ngram));
 
-			for (auto gram = grams.begin(); gram != grams.end(); ++gram) {
-				lb::ssegment_index wmap(lb::word, gram->begin(), gram->end(), m_loc);
-				wmap.rule(lb::word_any | lb::word_none);
+			uint64_t signature = dict_signature(path);
 
-				grammar tmp;
-				bool negative = false;
-				for (auto it = wmap.begin(), e = wmap.end(); it != e; ++it) {
-					if (it->rule() & lb::word_none) {
-						if (it->str() == "-")
-							negative = true;
-						continue;
-					}
+			std::shared_ptr<morph_index> morph = std::make_shared<morph_index>();
+			bool loaded = !index.empty() && load_index(index, signature, *morph);
 
-					token_entity ent = p.try_parse(it->str());
-					if (ent.position != -1) {
-						if (ent.position < (int)sizeof(parsed_word::feature_mask) * 8) {
-							if (negative)
-								tmp.negative |= (parsed_word::feature_mask)1 << ent.position;
-							else
-								tmp.features |= (parsed_word::feature_mask)1 << ent.position;
-						}
-					}
-				}
+			if (!loaded)
+				morph->prepare(m_spell->thread_num());
+			m_guesser.prepare(m_spell->thread_num());
+			m_spell->feed_dict(path, [&] (int idx, const parsed_word &rec) {
+					if (!loaded)
+						morph->add(idx, rec);
+					return m_guesser.add(idx, rec);
+				});
+			if (!loaded)
+				morph->freeze();
+			m_guesser.freeze();
 
-				std::cout << *gram << ": features: 0x" << std::hex << tmp.features << ", negative: " << tmp.negative << std::dec << std::endl;
-				ret.push_back(tmp);
+			std::shared_ptr<morph_snapshot> dict = std::make_shared<morph_snapshot>();
+			dict->base = morph;
+			publish(dict);
+
+			if (!loaded && !index.empty())
+				save_index(index, signature, *morph);
+
+			return loaded;
+		}
+
+		/*
+		 * Applies delta file (see delta.hpp) on top of the loaded dictionary, returns number of applied records.
+		 * Lookups see the change as soon as this method returns, changed words are merged into
+		 * the base index in background once there are compact_threshold of them.
+		 * Suffix guesser and fuzzy search are not updated until the dictionary is reloaded.
+		 */
+		size_t apply_delta(const std::string &path) {
+			return apply_delta(std::vector<std::string>(1, path));
+		}
+
+		// all files are read before the change is published, if any of them is invalid nothing is applied
+		size_t apply_delta(const std::vector<std::string> &paths) {
+			std::vector<delta_record> delta;
+			for (auto path = paths.begin(); path != paths.end(); ++path) {
+				std::vector<delta_record> tmp = read_delta(*path);
+				delta.insert(delta.end(), std::make_move_iterator(tmp.begin()), std::make_move_iterator(tmp.end()));
 			}
 
+			std::lock_guard<std::mutex> guard(m_update_lock);
+			std::shared_ptr<const morph_snapshot> cur = snapshot();
+
+			std::shared_ptr<morph_snapshot> dict = std::make_shared<morph_snapshot>();
+			dict->base = cur->base;
+			dict->overlay = std::make_shared<morph_overlay>(*cur->base, cur->overlay.get(), delta);
+			publish(dict);
+
+			if (!m_compacting && dict->overlay->words_num() >= m_compact_threshold)
+				start_compaction();
+
+			return delta.size();
+		}
+
+		void set_compact_threshold(size_t words) {
+			m_compact_threshold = words;
+		}
+
+		// waits until background compaction (if any) has been completed
+		void wait_compaction(void) {
+			std::unique_lock<std::mutex> guard(m_update_lock);
+			m_compaction_done.wait(guard, [this] { return !m_compacting; });
+		}
+
+		// current dictionary, it is not changed by the following updates
+		std::shared_ptr<const morph_snapshot> snapshot(void) const {
+			return std::atomic_load(&m_dict);
+		}
+
+		std::vector<grammar> generate(const std::vector<std::string> &grams) {
+			std::vector<grammar> ret;
+			ret.reserve(grams.size());
+
+			for (auto gram = grams.begin(); gram != grams.end(); ++gram)
+				ret.push_back(parse_grammar(gram->data(), gram->size()));
+
 			return ret;
 		}
 
 		std::vector<grammar> generate(const std::string &gram_string) {
-			std::vector<std::string> ret;
+			return parse_grammars(gram_string);
+		}
 
-			boost::split(ret, gram_string, boost::is_any_of("\t "));
-			return generate(ret);
+		// returns grammar compiled from @gram_string, compiled grammars are cached by their source string
+		shared_grammar compile(const std::string &gram_string) {
+			return m_grammars.get(gram_string);
 		}
 
 		std::vector<int> grammar_deduction_sentence(const std::vector<grammar> &gfeat, const std::string &sent) {
-			lb::ssegment_index wmap(lb::word, sent.begin(), sent.end(), m_loc);
-			wmap.rule(lb::word_any);
-
-			std::vector<word_features> wfeat;
-			for (auto it = wmap.begin(), e = wmap.end(); it != e; ++it) {
-				wfeat.emplace_back(it->str(), lookup(it->str()));
-			}
+			return grammar_deduction(gfeat, lookup_sentence(sent));
+		}
 
-			return grammar_deduction(gfeat, wfeat);
+		std::vector<int> grammar_deduction_sentence(const compiled_grammar &gram, const std::string &sent) {
+			return gram.matcher.match(lookup_sentence(sent))[0];
 		}
 
 		std::vector<int> grammar_deduction(const std::vector<grammar> &gfeat, const std::vector<word_features> &wfeat) {
-			// this is actually substring search, but I do not care about more optimized
-			// algorithms for now, since grammatics are supposed to be rather small
-
-			std::vector<int> gram_positions;
-
-			int gfeat_pos = 0;
-			auto gram_start = wfeat.begin();
-			for (auto it = wfeat.begin(); it != wfeat.end();) {
-				ef eftmp = found(gfeat[gfeat_pos], it->fvec);
-#ifdef WARP_STDOUT_DEBUG
-				std::cout << "grammar_deduction: word: " << it->word <<
-					", grammar position: " << gfeat_pos <<
-					", grammar-start: " << gram_start->word <<
-					", match-to: " << std::hex;
-				for (auto gw : it->fvec)
-					std::cout << "0x" << gw.features << " ";
-				std::cout << ", found-features: " << eftmp.features << std::dec << std::endl;
-#endif
-				if (!eftmp.features) {
-					// try next word if the first grammar entry doesn't match
-					if (gfeat_pos == 0) {
-						++it;
-						++gram_start;
-						continue;
-					}
-
-					gfeat_pos = 0;
-					++gram_start;
-					it = gram_start;
-					continue;
-				}
+			grammar_matcher m;
+			m.add(gfeat);
 
-				++gfeat_pos;
-
-				if (gfeat_pos != (int)gfeat.size()) {
-					++it;
-					continue;
-				}
+			return m.match(wfeat)[0];
+		}
 
-				// whole grammar has been found
-				gram_positions.push_back(gram_start - wfeat.begin());
-				gfeat_pos = 0;
+		// compiles multiple grammars into a single matcher, grammar id is its index in @grams
+		grammar_matcher compile(const std::vector<std::vector<grammar>> &grams) const {
+			grammar_matcher m;
+			for (auto g = grams.begin(); g != grams.end(); ++g)
+				m.add(*g);
 
-				++it;
-				gram_start = it;
-			}
+			return m;
+		}
 
-			return gram_positions;
+		// matches all grammars compiled into @m in a single pass, returns start positions for every grammar id
+		std::vector<std::vector<int>> grammar_deduction(const grammar_matcher &m, const std::vector<word_features> &wfeat) {
+			return m.match(wfeat);
 		}
 
 		std::vector<int> grammar_deduction(const std::vector<grammar> &gfeat, const std::vector<std::string> &words) {
@@ -185,89 +293,409 @@ class lex {
 			return grammar_deduction(gfeat, wfeat);
 		}
 
-		std::string root(const std::string &word) {
-			auto ret = m_spell->search(word);
-			if (ret.size())
-				return ret[0];
+		std::string root(const std::string &word) const {
+			bool partial;
+			return root(word, partial);
+		}
+
+		// dictionary words are looked up exactly, misspelled words at distance 1 are corrected,
+		// unknown words are analyzed by their suffixes if the suffix is long and frequent enough,
+		// fuzzy search runs for the rest and falls back to a weaker guess if nothing is found,
+		// @partial is set when search budget has been exhausted before the search has been completed
+		std::string root(const std::string &word, bool &partial) const {
+			partial = false;
+
+			// words changed by delta files are not known to the spell checker,
+			// removed words must not be found by it either
+			std::shared_ptr<const morph_snapshot> dict = snapshot();
+			if (dict->overlay) {
+				morph_index::range changed;
+				bool found = dict->overlay->lookup(word.data(), word.size(), changed);
+				if (!found) {
+					std::string lower = boost::locale::to_lower(word, m_loc);
+					if (lower != word)
+						found = dict->overlay->lookup(lower.data(), lower.size(), changed);
+				}
+
+				if (found) {
+					if (changed.first != changed.second)
+						return dict->lemma(changed.first);
+
+					auto guesses = guess(word);
+					if (guesses.size() && confident(guesses[0]))
+						return guesses[0].lemma;
+					return word;
+				}
+			}
+
+			search_budget budget(m_max_candidates, m_max_time);
+			auto ret = m_spell->lookup(word, 1, budget);
+			partial = ret.partial;
+			if (ret.lemmas.size())
+				return ret.lemmas[0].lemma;
+
+			auto guesses = guess(word);
+			if (guesses.size() && confident(guesses[0]))
+				return guesses[0].lemma;
+
+			if (!partial) {
+				ret = m_spell->lookup_fuzzy(word, 2, budget);
+				partial = ret.partial;
+				if (ret.lemmas.size())
+					return ret.lemmas[0].lemma;
+			}
+
+			if (guesses.size())
+				return guesses[0].lemma;
 			return word;
 		}
 
-		std::vector<word_features> lookup_sentence(const std::string &sent) {
-			std::vector<word_features> wf;
+		// out-of-vocabulary word analysis, guesses are sorted by descending frequency
+		std::vector<morph_guess> guess(const std::string &word) const {
+			return m_guesser.lookup(boost::locale::to_lower(word, m_loc));
+		}
+
+		analysis analyze(const std::string &text, const analyze_options &opt) const {
+			return analyze(text.data(), text.size(), opt);
+		}
+
+		analysis analyze(const char *text, size_t size, const analyze_options &opt) const {
+			analysis ret;
+			ret.text.assign(text, size);
+			ret.dict = snapshot();
+
+			const std::string &t = ret.text;
+
+			std::vector<token> words;
+			m_tok.tokenize(t.data(), t.size(), words);
+
+			ret.tokens.resize(words.size());
+			for (size_t i = 0; i < words.size(); ++i) {
+				ret.tokens[i].offset = words[i].offset;
+				ret.tokens[i].size = words[i].size;
+			}
 
-			lb::ssegment_index wmap(lb::word, sent.begin(), sent.end(), m_loc);
-			wmap.rule(lb::word_any);
+			for (auto tok = ret.tokens.begin(); tok != ret.tokens.end(); ++tok) {
+				const char *word = t.data() + tok->offset;
 
-			for (auto it = wmap.begin(), e = wmap.end(); it != e; ++it) {
-				const auto & res = lookup(it->str());
-				wf.emplace_back(it->str(), res);
+				if (opt.lookup || opt.gram)
+					tok->features = lookup_range(*ret.dict, word, tok->size);
+
+				if (opt.normalize) {
+					tok->root_offset = ret.arena.size();
+					ret.arena.append(root(std::string(word, tok->size), tok->partial));
+					tok->root_size = ret.arena.size() - tok->root_offset;
+				}
 			}
 
+			if (opt.gram) {
+				ret.grammar_starts = opt.gram->matcher.match(ret.tokens.size(), [&] (size_t i) {
+						return ret.tokens[i].features;
+					})[0];
+			}
+
+			return ret;
+		}
+
+		std::vector<word_features> lookup_sentence(const std::string &sent) {
+			analysis an = analyze(sent, analyze_options());
+
+			std::vector<word_features> wf;
+			wf.reserve(an.tokens.size());
+
+			for (size_t i = 0; i < an.tokens.size(); ++i)
+				wf.emplace_back(an.word(i).to_string(), to_ef(an.tokens[i].features));
+
 			return wf;
 		}
 
 		std::vector<std::string> normalize_sentence(const std::string &sent) {
-			lb::ssegment_index wmap(lb::word, sent.begin(), sent.end(), m_loc);
-			wmap.rule(lb::word_any);
+			analyze_options opt;
+			opt.lookup = false;
+			opt.normalize = true;
+
+			analysis an = analyze(sent, opt);
 
 			std::vector<std::string> roots;
-			for (auto it = wmap.begin(), e = wmap.end(); it != e; ++it) {
-				roots.emplace_back(root(it->str()));
-			}
+			roots.reserve(an.tokens.size());
+			for (size_t i = 0; i < an.tokens.size(); ++i)
+				roots.emplace_back(an.root(i).to_string());
 
 			return roots;
 		}
 
+		/*
+		 * Streaming normalization of large texts: text is cut into chunks of at most
+		 * @opt.chunk_size bytes at line, sentence or whitespace boundaries (words longer than that
+		 * are cut between characters), chunks are analyzed
+		 * in parallel and @process is called for every chunk in text order from the calling thread.
+		 * At most 2 * @opt.thread_num chunks are kept in memory.
+		 */
+		void normalize(const char *text, size_t size, const analysis_process &process,
+				const stream_options &opt = stream_options()) const {
+			auto pipeline = normalize_pipeline(process, opt);
+
+			while (size) {
+				size_t len = chunk_boundary(text, size, opt.chunk_size);
+
+				text_chunk ch;
+				ch.ptr = text;
+				ch.size = len;
+				pipeline->push(std::move(ch));
+
+				text += len;
+				size -= len;
+			}
+
+			pipeline->finish();
+		}
+
+		void normalize(std::istream &in, const analysis_process &process,
+				const stream_options &opt = stream_options()) const {
+			auto pipeline = normalize_pipeline(process, opt);
+
+			const size_t chunk_size = std::max<size_t>(opt.chunk_size, 1);
+
+			std::string buf;
+			while (in) {
+				size_t have = buf.size();
+				buf.resize(have + chunk_size);
+				in.read(&buf[have], chunk_size);
+				buf.resize(have + in.gcount());
+
+				// the last byte may be followed by the rest of the word in the stream,
+				// buffer never holds more than 2 * @chunk_size bytes
+				size_t len = buf.size();
+				if (in)
+					len = chunk_boundary(buf.data(), buf.size(), std::min(chunk_size, buf.size() - 1));
+				if (!len)
+					break;
+
+				text_chunk ch;
+				ch.buf.assign(buf, 0, len);
+				ch.size = len;
+				pipeline->push(std::move(ch));
+
+				buf.erase(0, len);
+			}
+
+			pipeline->finish();
+		}
+
+		void normalize_file(const std::string &path, const analysis_process &process,
+				const stream_options &opt = stream_options()) const {
+			mapped_file file(path);
+			normalize(file.data(), file.size(), process, opt);
+		}
+
+		// does not allocate, returned range is valid while @dict exists
+		morph_index::range lookup_range(const morph_snapshot &dict, const char *word, size_t size) const {
+			auto ret = dict.lookup(word, size);
+			if (ret.first == ret.second) {
+				std::string lower = boost::locale::to_lower(word, word + size, m_loc);
+				if (lower.size() != size || memcmp(lower.data(), word, size))
+					ret = dict.lookup(lower.data(), lower.size());
+			}
+
+			return ret;
+		}
+
 		std::vector<ef> lookup(const std::string &word) {
-			return std::vector<ef>();
+			std::shared_ptr<const morph_snapshot> dict = snapshot();
+			return to_ef(lookup_range(*dict, word.data(), word.size()));
 		}
 
 	private:
+		struct text_chunk {
+			const char *ptr;
+			size_t size;
+			// owned chunk data, used when @ptr is NULL
+			std::string buf;
+
+			text_chunk() : ptr(NULL), size(0) {}
+		};
+
+		typedef ordered_pipeline<text_chunk, analysis> normalizer;
+
+		static bool confident(const morph_guess &g) {
+			return g.suffix >= guess_min_suffix && g.count >= guess_min_count;
+		}
+
 		std::locale m_loc;
+		tokenizer m_tok;
 		std::auto_ptr<warp::spell> m_spell;
+		suffix_guesser m_guesser;
+		grammar_cache m_grammars;
+		long m_max_candidates, m_max_time;
+
+		// accessed with atomic_load/atomic_store, updates are serialized by m_update_lock
+		std::shared_ptr<const morph_snapshot> m_dict;
+		std::mutex m_update_lock;
+		std::condition_variable m_compaction_done;
+		std::thread m_compaction;
+		size_t m_compact_threshold;
+		bool m_compacting;
+
+		// dictionary files are identified by their paths, sizes and modification times
+		static uint64_t dict_signature(const std::vector<std::string> &path) {
+			uint64_t h = 0;
+
+			for (auto p = path.begin(); p != path.end(); ++p) {
+				uint64_t meta[3] = {0, 0, 0};
+
+				struct stat st;
+				if (stat(p->c_str(), &st) == 0) {
+					meta[0] = st.st_size;
+					meta[1] = st.st_mtim.tv_sec;
+					meta[2] = st.st_mtim.tv_nsec;
+				}
 
-		int bits_set(parsed_word::feature_mask tmp) {
-			int pos;
-			int count = 0;
-			while ((pos = ffsll(tmp)) != 0) {
-				tmp >>= pos;
-				count++;
+				h = hash_bytes(p->data(), p->size(), h);
+				h = hash_bytes((const char *)meta, sizeof(meta), h);
 			}
 
-			return count;
+			return h;
 		}
 
-		ef found(const grammar &mask, const std::vector<ef> &features) {
-			int request_max_count = bits_set(mask.features);
-			int max_count = 0;
+		// index file is the dictionary signature followed by the saved morph index
+		static bool load_index(const std::string &index, uint64_t signature, morph_index &morph) {
+			std::ifstream in(index.c_str(), std::ios::binary);
+			if (!in)
+				return false;
 
-			ef max_ef;
-			for (auto fres = features.begin(); fres != features.end(); ++fres) {
-				if (mask.negative & fres->features)
-					continue;
+			uint64_t saved = 0;
+			in.read((char *)&saved, sizeof(saved));
+			if (!in.good() || saved != signature)
+				return false;
 
-				int count = bits_set(mask.features & fres->features);
+			return morph.load(in);
+		}
+
+		// index is written into a temporary file which is then renamed, so readers never see partial index
+		static void save_index(const std::string &index, uint64_t signature, const morph_index &morph) {
+			std::string tmp = index + ".tmp";
 
-				if (count > max_count) {
-					max_ef = *fres;
-					max_count = count;
+			{
+				std::ofstream out(tmp.c_str(), std::ios::binary | std::ios::trunc);
+				out.write((const char *)&signature, sizeof(signature));
+				if (!out.good() || !morph.save(out) || !out.flush()) {
+					unlink(tmp.c_str());
+					throw std::runtime_error("could not write morph index '" + tmp + "'");
 				}
 			}
 
-#ifdef WARP_STDOUT_DEBUG
-			std::cout << "found: requested mask: 0x" << std::hex << mask.features <<
-				", negative: 0x" << mask.negative <<
-				", requested bits: " << std::dec << request_max_count <<
-				", best-match: 0x" << std::hex << max_ef.features <<
-				", bits-intersection: " << std::dec << max_count <<
-				std::endl;
-#endif
-			if (max_count >= request_max_count)
-				return max_ef;
+			if (rename(tmp.c_str(), index.c_str())) {
+				unlink(tmp.c_str());
+				throw std::runtime_error("could not rename morph index '" + tmp + "' to '" + index + "'");
+			}
+		}
+
+		static std::shared_ptr<const morph_snapshot> empty_dict(void) {
+			std::shared_ptr<morph_snapshot> dict = std::make_shared<morph_snapshot>();
+			dict->base = std::make_shared<morph_index>();
+			return dict;
+		}
+
+		void publish(const std::shared_ptr<const morph_snapshot> &dict) {
+			std::atomic_store(&m_dict, dict);
+		}
+
+		// called with m_update_lock held, merges current overlay into the new base index
+		void start_compaction(void) {
+			if (m_compaction.joinable())
+				m_compaction.join();
+
+			m_compacting = true;
+			std::shared_ptr<const morph_snapshot> dict = snapshot();
+
+			m_compaction = std::thread([this, dict] {
+					std::shared_ptr<const morph_index> base = dict->compact();
+
+					std::lock_guard<std::mutex> guard(m_update_lock);
+					std::shared_ptr<const morph_snapshot> cur = snapshot();
+
+					// deltas applied while compaction was running stay in the overlay
+					if (cur->base == dict->base) {
+						std::shared_ptr<morph_snapshot> next = std::make_shared<morph_snapshot>();
+						next->base = base;
+						next->overlay = std::make_shared<morph_overlay>(*cur->overlay, *dict->overlay);
+						publish(next);
+					}
+
+					m_compacting = false;
+					m_compaction_done.notify_all();
+				});
+		}
+
+		std::unique_ptr<normalizer> normalize_pipeline(const analysis_process &process, const stream_options &opt) const {
+			int thread_num = opt.thread_num;
+			if (thread_num <= 0)
+				thread_num = std::max(1U, std::thread::hardware_concurrency());
+
+			analyze_options aopt;
+			aopt.lookup = false;
+			aopt.normalize = true;
+
+			return std::unique_ptr<normalizer>(new normalizer(thread_num, thread_num * 2,
+				[this, aopt] (text_chunk &ch) {
+					return analyze(ch.ptr ? ch.ptr : ch.buf.data(), ch.size, aopt);
+				},
+				[&process] (analysis &an) {
+					process(an);
+				}));
+		}
+
+		// returns length of the first chunk of @text, it ends at whitespace if there is any in the first
+		// @chunk_size bytes, otherwise a word longer than that is cut between characters
+		static size_t chunk_boundary(const char *text, size_t size, size_t chunk_size) {
+			chunk_size = std::max<size_t>(chunk_size, 1);
+			if (size <= chunk_size)
+				return size;
+
+			// prefer line end, then sentence end, then any whitespace in the second half of the chunk
+			const char *min = text + chunk_size / 2;
+			const char *max = text + chunk_size;
+
+			for (const char *p = max; p > min; --p) {
+				if (p[-1] == '\n')
+					return p - text;
+			}
+
+			for (const char *p = max; p > min + 1; --p) {
+				if (isspace((unsigned char)p[-1]) && (p[-2] == '.' || p[-2] == '!' || p[-2] == '?'))
+					return p - text;
+			}
+
+			for (const char *p = max; p > text; --p) {
+				if (isspace((unsigned char)p[-1]))
+					return p - text;
+			}
+
+			// no whitespace at all, the token is cut at the last complete UTF-8 character
+			const char *p = max;
+			while (p > text && ((unsigned char)*p & 0xc0) == 0x80)
+				--p;
+			if (p == text) {
+				for (p = max; p < text + size && ((unsigned char)*p & 0xc0) == 0x80; ++p);
+			}
 
-			return ef();
+			return p - text;
 		}
 
+		static std::vector<ef> to_ef(const morph_index::range &r) {
+			std::vector<ef> ret;
+			ret.reserve(r.second - r.first);
+
+			for (auto e = r.first; e != r.second; ++e) {
+				ef tmp;
+				tmp.features = e->features;
+				tmp.ending_len = e->ending_len;
+
+				ret.push_back(tmp);
+			}
+
+			return ret;
+		}
 };
 
 }} // namespace ioremap::warp
@@ -193,6 +193,92 @@ class lconvert {
 			ss << l;
 			return ss.str();
 		}
+
+		// plain code point decoder without locale machinery, invalid bytes are returned as is
+		static unsigned int next_utf8(const char *&ptr, const char *end) {
+			unsigned char c = *ptr++;
+			int tail;
+			unsigned int code;
+
+			if (c < 0x80)
+				return c;
+			else if ((c & 0xe0) == 0xc0) {
+				code = c & 0x1f;
+				tail = 1;
+			} else if ((c & 0xf0) == 0xe0) {
+				code = c & 0x0f;
+				tail = 2;
+			} else if ((c & 0xf8) == 0xf0) {
+				code = c & 0x07;
+				tail = 3;
+			} else
+				return c;
+
+			for (; tail > 0 && ptr < end && (*ptr & 0xc0) == 0x80; --tail)
+				code = (code << 6) | (*ptr++ & 0x3f);
+
+			return code;
+		}
+
+		/*
+		 * Lowercases ASCII and Cyrillic text without locale machinery.
+		 * Returns false and leaves @out unfinished if there are other non-ASCII characters,
+		 * such text must be lowercased with boost::locale.
+		 */
+		static bool fast_lower(const char *text, size_t size, std::string &out) {
+			out.resize(size);
+
+			for (size_t i = 0; i < size; ++i) {
+				unsigned char c = text[i];
+
+				if (c < 0x80) {
+					out[i] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+					continue;
+				}
+
+				if ((c != 0xd0 && c != 0xd1) || i + 1 >= size || ((unsigned char)text[i + 1] & 0xc0) != 0x80)
+					return false;
+
+				unsigned char n = text[i + 1];
+				if (c == 0xd0 && n >= 0x90 && n <= 0x9f) {		// А-П
+					out[i] = c;
+					out[i + 1] = n + 0x20;
+				} else if (c == 0xd0 && n >= 0xa0 && n <= 0xaf) {	// Р-Я
+					out[i] = 0xd1;
+					out[i + 1] = n - 0x20;
+				} else if (c == 0xd0 && n < 0x90) {			// Ѐ-Џ, including Ё
+					out[i] = 0xd1;
+					out[i + 1] = n + 0x10;
+				} else if (c == 0xd1 && n >= 0xa0) {			// historic letters
+					return false;
+				} else {
+					out[i] = c;
+					out[i + 1] = n;
+				}
+
+				++i;
+			}
+
+			return true;
+		}
+
+		static void append_utf8(std::string &out, unsigned int code) {
+			if (code < 0x80) {
+				out.push_back(code);
+			} else if (code < 0x800) {
+				out.push_back(0xc0 | (code >> 6));
+				out.push_back(0x80 | (code & 0x3f));
+			} else if (code < 0x10000) {
+				out.push_back(0xe0 | (code >> 12));
+				out.push_back(0x80 | ((code >> 6) & 0x3f));
+				out.push_back(0x80 | (code & 0x3f));
+			} else {
+				out.push_back(0xf0 | (code >> 18));
+				out.push_back(0x80 | ((code >> 12) & 0x3f));
+				out.push_back(0x80 | ((code >> 6) & 0x3f));
+				out.push_back(0x80 | (code & 0x3f));
+			}
+		}
 };
 
 }} // ioremap::warp
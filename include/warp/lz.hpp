@@ -0,0 +1,212 @@
+/*
+ * Copyright 2014+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WARP_LZ_HPP
+#define __WARP_LZ_HPP
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <string.h>
+
+namespace ioremap { namespace warp {
+
+/*
+ * Byte-oriented LZ77 codec with the LZ4 block layout.
+ *
+ * Compressed data is a sequence of
+ *	token: high nibble is the number of literals, low nibble is match length - min_match,
+ *		15 means that length continues in the following bytes, every byte is added to it
+ *		until a byte is not 255
+ *	literals
+ *	match offset, 2 bytes little-endian, followed by match length continuation bytes
+ * The last sequence has literals only. Compressor looks for matches with a single hash table
+ * of 4 byte sequences, this is fast and is good enough for dictionary data with its long shared prefixes.
+ */
+namespace lz {
+
+enum {
+	min_match = 4,
+	max_offset = 65535,
+	hash_bits = 16
+};
+
+// maximum size of the compressed data for @size input bytes
+static inline size_t bound(size_t size)
+{
+	return size + size / 255 + 16;
+}
+
+static inline uint32_t load32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t hash32(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - hash_bits);
+}
+
+static inline unsigned char *put_length(unsigned char *dst, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*dst++ = 255;
+	*dst++ = len;
+	return dst;
+}
+
+static inline unsigned char *put_sequence(unsigned char *dst, const unsigned char *lit, size_t lit_len,
+		size_t offset, size_t match_len)
+{
+	unsigned char *token = dst++;
+	*token = (lit_len < 15 ? lit_len : 15) << 4;
+	if (lit_len >= 15)
+		dst = put_length(dst, lit_len - 15);
+
+	memcpy(dst, lit, lit_len);
+	dst += lit_len;
+
+	if (!match_len)
+		return dst;
+
+	*dst++ = offset & 0xff;
+	*dst++ = offset >> 8;
+
+	match_len -= min_match;
+	*token |= match_len < 15 ? match_len : 15;
+	if (match_len >= 15)
+		dst = put_length(dst, match_len - 15);
+
+	return dst;
+}
+
+// compresses @size bytes into @dst which must have at least bound(@size) bytes, returns compressed size
+static inline size_t compress(const char *src, size_t size, char *dst)
+{
+	const unsigned char *in = (const unsigned char *)src;
+	const unsigned char *end = in + size;
+	unsigned char *out = (unsigned char *)dst;
+
+	std::vector<uint32_t> table(1 << hash_bits, ~0U);
+
+	const unsigned char *anchor = in;
+	const unsigned char *p = in;
+
+	while (size >= min_match && p <= end - min_match) {
+		uint32_t seq = load32(p);
+		uint32_t &slot = table[hash32(seq)];
+		uint32_t cand = slot;
+		slot = p - in;
+
+		if (cand == ~0U || (size_t)(p - in) - cand > max_offset || load32(in + cand) != seq) {
+			++p;
+			continue;
+		}
+
+		const unsigned char *m = in + cand + min_match;
+		const unsigned char *q = p + min_match;
+		while (q < end && *q == *m) {
+			++q;
+			++m;
+		}
+
+		out = put_sequence(out, anchor, p - anchor, p - (in + cand), q - p);
+
+		p = q;
+		anchor = p;
+	}
+
+	out = put_sequence(out, anchor, end - anchor, 0, 0);
+	return out - (unsigned char *)dst;
+}
+
+// returns false if data is corrupted or it does not decompress into exactly @raw_size bytes
+static inline bool decompress(const char *src, size_t size, char *dst, size_t raw_size)
+{
+	const unsigned char *in = (const unsigned char *)src;
+	const unsigned char *in_end = in + size;
+	unsigned char *out = (unsigned char *)dst;
+	unsigned char *out_end = out + raw_size;
+
+	auto get_length = [&] (size_t &len) -> bool {
+		unsigned char c;
+		do {
+			if (in == in_end)
+				return false;
+			c = *in++;
+			len += c;
+		} while (c == 255);
+		return true;
+	};
+
+	while (in < in_end) {
+		unsigned char token = *in++;
+
+		size_t lit_len = token >> 4;
+		if (lit_len == 15 && !get_length(lit_len))
+			return false;
+
+		if ((size_t)(in_end - in) < lit_len || (size_t)(out_end - out) < lit_len)
+			return false;
+		memcpy(out, in, lit_len);
+		in += lit_len;
+		out += lit_len;
+
+		// the last sequence has no match
+		if (in == in_end)
+			break;
+
+		if (in_end - in < 2)
+			return false;
+		size_t offset = in[0] | (in[1] << 8);
+		in += 2;
+
+		size_t match_len = token & 0x0f;
+		if (match_len == 15 && !get_length(match_len))
+			return false;
+		match_len += min_match;
+
+		if (!offset || offset > (size_t)(out - (unsigned char *)dst) || (size_t)(out_end - out) < match_len)
+			return false;
+
+		// source and destination overlap when offset is less than match length
+		const unsigned char *m = out - offset;
+		if (offset >= match_len) {
+			memcpy(out, m, match_len);
+			out += match_len;
+		} else {
+			for (size_t i = 0; i < match_len; ++i)
+				*out++ = *m++;
+		}
+	}
+
+	return out == out_end;
+}
+
+static inline void compress(const char *src, size_t size, std::string &out)
+{
+	out.resize(bound(size));
+	out.resize(compress(src, size, &out[0]));
+}
+
+} // namespace lz
+
+}} // namespace ioremap::warp
+
+#endif /* __WARP_LZ_HPP */
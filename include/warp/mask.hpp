@@ -0,0 +1,154 @@
+/*
+ * Copyright 2014+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WARP_MASK_HPP
+#define __WARP_MASK_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace ioremap { namespace warp {
+
+/*
+ * Fixed size bit mask made of 64-bit words, word 0 holds bits 0-63.
+ * Bitwise operations are plain loops over a handful of words which compilers unroll and vectorize,
+ * match() tests the whole mask at once with SSE2 when it is available.
+ */
+template <size_t Bits>
+struct basic_mask {
+	static_assert(Bits > 0 && Bits % 64 == 0, "mask size must be a multiple of 64 bits");
+
+	enum {
+		bits = Bits,
+		words = Bits / 64,
+	};
+
+	uint64_t w[words];
+
+	basic_mask() {
+		for (size_t i = 0; i < words; ++i)
+			w[i] = 0;
+	}
+
+	// mask with the lowest 64 bits set to @low
+	explicit basic_mask(uint64_t low) {
+		w[0] = low;
+		for (size_t i = 1; i < words; ++i)
+			w[i] = 0;
+	}
+
+	bool test(size_t pos) const {
+		return (w[pos / 64] >> (pos % 64)) & 1;
+	}
+
+	void set(size_t pos) {
+		w[pos / 64] |= 1ULL << (pos % 64);
+	}
+
+	bool any(void) const {
+		uint64_t acc = 0;
+		for (size_t i = 0; i < words; ++i)
+			acc |= w[i];
+		return acc != 0;
+	}
+
+	int count(void) const {
+		int ret = 0;
+		for (size_t i = 0; i < words; ++i)
+			ret += __builtin_popcountll(w[i]);
+		return ret;
+	}
+
+	basic_mask &operator|=(const basic_mask &other) {
+		for (size_t i = 0; i < words; ++i)
+			w[i] |= other.w[i];
+		return *this;
+	}
+
+	basic_mask &operator&=(const basic_mask &other) {
+		for (size_t i = 0; i < words; ++i)
+			w[i] &= other.w[i];
+		return *this;
+	}
+
+	basic_mask operator|(const basic_mask &other) const {
+		basic_mask ret(*this);
+		ret |= other;
+		return ret;
+	}
+
+	basic_mask operator&(const basic_mask &other) const {
+		basic_mask ret(*this);
+		ret &= other;
+		return ret;
+	}
+
+	bool operator==(const basic_mask &other) const {
+		uint64_t acc = 0;
+		for (size_t i = 0; i < words; ++i)
+			acc |= w[i] ^ other.w[i];
+		return acc == 0;
+	}
+
+	bool operator!=(const basic_mask &other) const {
+		return !(*this == other);
+	}
+
+	// orders masks as numbers
+	bool operator<(const basic_mask &other) const {
+		for (size_t i = words; i-- > 0;) {
+			if (w[i] != other.w[i])
+				return w[i] < other.w[i];
+		}
+		return false;
+	}
+};
+
+/*
+ * Returns 1 if @features has all bits of @required and none of @negative, 0 otherwise.
+ * This is a branchless check, it is used to test many entries in a row.
+ */
+template <size_t Bits>
+static inline unsigned int mask_match(const basic_mask<Bits> &features, const basic_mask<Bits> &required,
+		const basic_mask<Bits> &negative)
+{
+#ifdef __SSE2__
+	if (Bits % 128 == 0) {
+		__m128i acc = _mm_setzero_si128();
+		for (size_t i = 0; i < Bits / 64; i += 2) {
+			__m128i f = _mm_loadu_si128((const __m128i *)&features.w[i]);
+			__m128i r = _mm_loadu_si128((const __m128i *)&required.w[i]);
+			__m128i n = _mm_loadu_si128((const __m128i *)&negative.w[i]);
+
+			acc = _mm_or_si128(acc, _mm_or_si128(_mm_andnot_si128(f, r), _mm_and_si128(f, n)));
+		}
+
+		return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xffff;
+	}
+#endif
+	uint64_t acc = 0;
+	for (size_t i = 0; i < Bits / 64; ++i)
+		acc |= (required.w[i] & ~features.w[i]) | (features.w[i] & negative.w[i]);
+	return acc == 0;
+}
+
+}} // namespace ioremap::warp
+
+#endif /* __WARP_MASK_HPP */
@@ -0,0 +1,93 @@
+/*
+ * Copyright 2014+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WARP_MMAP_HPP
+#define __WARP_MMAP_HPP
+
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace ioremap { namespace warp {
+
+// read-only memory mapping of the whole file, unmapped in destructor
+class mapped_file {
+	public:
+		mapped_file(const std::string &path) : m_data(NULL), m_size(0) {
+			int fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0)
+				throw_error("could not open", path, errno);
+
+			struct stat st;
+			if (fstat(fd, &st) < 0) {
+				int err = errno;
+				close(fd);
+				throw_error("could not stat", path, err);
+			}
+
+			m_size = st.st_size;
+			if (m_size) {
+				void *data = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (data == MAP_FAILED) {
+					int err = errno;
+					close(fd);
+					throw_error("could not map", path, err);
+				}
+
+				m_data = (const char *)data;
+				madvise(data, m_size, MADV_SEQUENTIAL);
+			}
+
+			close(fd);
+		}
+
+		~mapped_file() {
+			if (m_data)
+				munmap((void *)m_data, m_size);
+		}
+
+		mapped_file(const mapped_file &) = delete;
+		mapped_file &operator=(const mapped_file &) = delete;
+
+		const char *data(void) const {
+			return m_data;
+		}
+
+		size_t size(void) const {
+			return m_size;
+		}
+
+	private:
+		const char *m_data;
+		size_t m_size;
+
+		static void throw_error(const char *what, const std::string &path, int err) {
+			std::ostringstream ss;
+			ss << "mapped_file: " << what << " file '" << path << "': " << strerror(err) << ": " << -err;
+			throw std::runtime_error(ss.str());
+		}
+};
+
+}} // namespace ioremap::warp
+
+#endif /* __WARP_MMAP_HPP */
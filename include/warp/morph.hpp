@@ -0,0 +1,311 @@
+/*
+ * Copyright 2014+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WARP_MORPH_HPP
+#define __WARP_MORPH_HPP
+
+#include "warp/feature.hpp"
+#include "warp/frozen.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <string.h>
+
+namespace ioremap { namespace warp {
+
+struct morph_entry {
+	parsed_word::feature_mask	features;
+	int				ending_len;
+	uint32_t			lemma_id;
+};
+
+/*
+ * Word form -> (features, ending length, lemma) index.
+ *
+ * Records are collected into per-thread buffers while dictionary is being unpacked,
+ * freeze() builds the final read-only structure: entries of every form are stored
+ * contiguously in a single array, forms are looked up in a frozen hash table,
+ * lemmas live in a single string pool. Lookup does not allocate memory.
+ *
+ * Frozen index can be saved and loaded back without rebuilding it, see save()/load().
+ */
+class morph_index {
+	public:
+		typedef std::pair<const morph_entry *, const morph_entry *> range;
+
+		morph_index() {}
+
+		// must be called before records are added, @thread_num is the number of threads which will call add()
+		void prepare(int thread_num) {
+			m_pending.clear();
+			m_pending.resize(thread_num);
+		}
+
+		bool add(int idx, const parsed_word &rec) {
+			m_pending[idx].push_back(rec);
+			return true;
+		}
+
+		void freeze(void) {
+			std::vector<const parsed_word *> recs;
+
+			size_t total = 0;
+			for (auto p = m_pending.begin(); p != m_pending.end(); ++p)
+				total += p->size();
+
+			recs.reserve(total);
+			for (auto p = m_pending.begin(); p != m_pending.end(); ++p) {
+				for (auto rec = p->begin(); rec != p->end(); ++rec)
+					recs.push_back(&*rec);
+			}
+
+			auto key = [] (const parsed_word *rec) {
+				return std::tie(rec->word, rec->lemma, rec->features, rec->ending_len);
+			};
+
+			std::sort(recs.begin(), recs.end(), [&] (const parsed_word *a, const parsed_word *b) {
+					return key(a) < key(b);
+				});
+			recs.erase(std::unique(recs.begin(), recs.end(), [&] (const parsed_word *a, const parsed_word *b) {
+					return key(a) == key(b);
+				}), recs.end());
+
+			std::vector<std::string> lemmas;
+			lemmas.reserve(recs.size());
+			for (auto rec = recs.begin(); rec != recs.end(); ++rec)
+				lemmas.push_back((*rec)->lemma);
+
+			std::sort(lemmas.begin(), lemmas.end());
+			lemmas.erase(std::unique(lemmas.begin(), lemmas.end()), lemmas.end());
+
+			m_lemma_pool.clear();
+			m_lemma_offsets.clear();
+			for (auto l = lemmas.begin(); l != lemmas.end(); ++l) {
+				m_lemma_offsets.push_back(m_lemma_pool.size());
+				m_lemma_pool.append(*l);
+			}
+			m_lemma_offsets.push_back(m_lemma_pool.size());
+
+			std::vector<std::string> forms;
+			m_entries.clear();
+			m_entries.reserve(recs.size());
+			m_offsets.clear();
+
+			for (auto rec = recs.begin(); rec != recs.end(); ++rec) {
+				if (forms.empty() || forms.back() != (*rec)->word) {
+					forms.push_back((*rec)->word);
+					m_offsets.push_back(m_entries.size());
+				}
+
+				morph_entry e;
+				e.features = (*rec)->features;
+				e.ending_len = (*rec)->ending_len;
+				e.lemma_id = std::lower_bound(lemmas.begin(), lemmas.end(), (*rec)->lemma) - lemmas.begin();
+
+				m_entries.push_back(e);
+			}
+			m_offsets.push_back(m_entries.size());
+
+			m_forms.build(forms);
+
+			std::vector<std::vector<parsed_word>>().swap(m_pending);
+		}
+
+		range lookup(const char *word, size_t size) const {
+			uint32_t id = m_forms.find(word, size);
+			if (id == frozen_hash::npos)
+				return range(NULL, NULL);
+
+			const morph_entry *base = m_entries.data();
+			return range(base + m_offsets[id], base + m_offsets[id + 1]);
+		}
+
+		range lookup(const std::string &word) const {
+			return lookup(word.data(), word.size());
+		}
+
+		std::string lemma(uint32_t lemma_id) const {
+			return m_lemma_pool.substr(m_lemma_offsets[lemma_id],
+					m_lemma_offsets[lemma_id + 1] - m_lemma_offsets[lemma_id]);
+		}
+
+		bool owns(const morph_entry *e) const {
+			return e >= m_entries.data() && e < m_entries.data() + m_entries.size();
+		}
+
+		// calls @process for every record of the frozen index, records of the same form go one after another
+		template <typename Process>
+		void for_each(Process process) const {
+			parsed_word rec;
+
+			m_forms.for_each([&] (uint32_t id, const char *word, size_t size) {
+					rec.word.assign(word, size);
+
+					for (uint32_t i = m_offsets[id]; i < m_offsets[id + 1]; ++i) {
+						const morph_entry &e = m_entries[i];
+						uint32_t l = e.lemma_id;
+
+						rec.lemma.assign(m_lemma_pool, m_lemma_offsets[l], m_lemma_offsets[l + 1] - m_lemma_offsets[l]);
+						rec.features = e.features;
+						rec.ending_len = e.ending_len;
+
+						process(rec);
+					}
+				});
+		}
+
+		size_t forms_num(void) const {
+			return m_forms.size();
+		}
+
+		size_t entries_num(void) const {
+			return m_entries.size();
+		}
+
+		bool save(std::ostream &out) const {
+			header h;
+			memcpy(h.magic, "WMIX", 4);
+			h.version = serialization_version;
+			h.feature_bits = parsed_word::feature_mask::bits;
+			h.entry_size = sizeof(morph_entry);
+			h.entries_num = m_entries.size();
+			h.offsets_num = m_offsets.size();
+			h.lemma_offsets_num = m_lemma_offsets.size();
+			h.lemma_pool_size = m_lemma_pool.size();
+
+			out.write((const char *)&h, sizeof(h));
+			if (!m_forms.save(out))
+				return false;
+
+			out.write((const char *)m_entries.data(), m_entries.size() * sizeof(morph_entry));
+			out.write((const char *)m_offsets.data(), m_offsets.size() * sizeof(uint32_t));
+			out.write((const char *)m_lemma_offsets.data(), m_lemma_offsets.size() * sizeof(uint32_t));
+			out.write(m_lemma_pool.data(), m_lemma_pool.size());
+
+			return out.good();
+		}
+
+		// on error the index is left empty
+		bool load(std::istream &in) {
+			clear();
+
+			header h;
+			in.read((char *)&h, sizeof(h));
+			if (!in.good() || memcmp(h.magic, "WMIX", 4) || h.version != serialization_version ||
+					h.feature_bits != parsed_word::feature_mask::bits || h.entry_size != sizeof(morph_entry) ||
+					h.entries_num > max_load_size || h.offsets_num > max_load_size ||
+					h.lemma_offsets_num > max_load_size || h.lemma_pool_size > max_load_size) {
+				std::cerr << "morph_index: invalid header" << std::endl;
+				return false;
+			}
+
+			if (!m_forms.load(in))
+				return false;
+
+			m_entries.resize(h.entries_num);
+			m_offsets.resize(h.offsets_num);
+			m_lemma_offsets.resize(h.lemma_offsets_num);
+			m_lemma_pool.resize(h.lemma_pool_size);
+
+			in.read((char *)m_entries.data(), m_entries.size() * sizeof(morph_entry));
+			in.read((char *)m_offsets.data(), m_offsets.size() * sizeof(uint32_t));
+			in.read((char *)m_lemma_offsets.data(), m_lemma_offsets.size() * sizeof(uint32_t));
+			in.read(&m_lemma_pool[0], m_lemma_pool.size());
+			if (!in.good()) {
+				std::cerr << "morph_index: truncated data" << std::endl;
+				clear();
+				return false;
+			}
+
+			if (!consistent()) {
+				std::cerr << "morph_index: inconsistent data" << std::endl;
+				clear();
+				return false;
+			}
+
+			return true;
+		}
+
+		void clear(void) {
+			std::vector<std::vector<parsed_word>>().swap(m_pending);
+			m_forms.clear();
+			m_offsets.clear();
+			m_entries.clear();
+			m_lemma_pool.clear();
+			m_lemma_offsets.clear();
+		}
+
+	private:
+		enum {
+			serialization_version = 1
+		};
+
+		// sanity limit of the array sizes read from the header
+		static const uint64_t max_load_size = 1ULL << 40;
+
+		struct header {
+			char		magic[4];
+			uint32_t	version;
+			uint32_t	feature_bits;
+			uint32_t	entry_size;
+			uint64_t	entries_num;
+			uint64_t	offsets_num;
+			uint64_t	lemma_offsets_num;
+			uint64_t	lemma_pool_size;
+		};
+
+		// offsets go up and stay within the arrays they point to, every entry refers to an existing lemma
+		bool consistent(void) const {
+			if (m_offsets.size() != m_forms.size() + 1 || m_offsets.front() != 0 || m_offsets.back() != m_entries.size())
+				return false;
+			for (size_t i = 1; i < m_offsets.size(); ++i) {
+				if (m_offsets[i] < m_offsets[i - 1])
+					return false;
+			}
+
+			if (m_lemma_offsets.empty() || m_lemma_offsets.front() != 0 || m_lemma_offsets.back() != m_lemma_pool.size())
+				return false;
+			for (size_t i = 1; i < m_lemma_offsets.size(); ++i) {
+				if (m_lemma_offsets[i] < m_lemma_offsets[i - 1])
+					return false;
+			}
+
+			for (auto e = m_entries.begin(); e != m_entries.end(); ++e) {
+				if ((size_t)e->lemma_id + 1 >= m_lemma_offsets.size())
+					return false;
+			}
+
+			return true;
+		}
+
+		std::vector<std::vector<parsed_word>> m_pending;
+
+		frozen_hash m_forms;
+		// entries of the form with id @i are [m_offsets[i], m_offsets[i + 1])
+		std::vector<uint32_t> m_offsets;
+		std::vector<morph_entry> m_entries;
+
+		std::string m_lemma_pool;
+		std::vector<uint32_t> m_lemma_offsets;
+};
+
+}} // namespace ioremap::warp
+
+#endif /* __WARP_MORPH_HPP */
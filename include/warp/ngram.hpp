@@ -17,10 +17,10 @@
 #ifndef __WARP_NGRAM_HPP
 #define __WARP_NGRAM_HPP
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <map>
-#include <set>
 #include <string>
 #include <sstream>
 #include <vector>
@@ -49,14 +49,15 @@ class ngram {
 	};
 
 	struct ngram_meta {
-		std::set<ngram_index_data> data;
+		// one entry per data index, sorted by data index once index is frozen
+		std::vector<ngram_index_data> data;
 		double count;
 
 		ngram_meta() : count(1.0) {}
 	};
 
 	public:
-		ngram(int n) : m_n(n) {}
+		ngram(int n) : m_n(n), m_frozen(false) {}
 
 		static std::vector<S> split(const S &text, size_t ngram) {
 			std::vector<S> ret;
@@ -76,6 +77,8 @@ class ngram {
 			int position = 0;
 			size_t index;
 
+			m_frozen = false;
+
 			auto it = m_data_index.find(d);
 			if (it == m_data_index.end()) {
 				index = m_data.size();
@@ -95,15 +98,55 @@ class ngram {
 				if (it == m_map.end()) {
 					ngram_meta meta;
 
-					meta.data.insert(data);
+					meta.data.push_back(data);
 					m_map[*word] = meta;
 				} else {
 					it->second.count++;
-					it->second.data.insert(data);
+
+					// the same gram can be met several times in the word, only the first position is saved
+					if (it->second.data.back().data_index != index)
+						it->second.data.push_back(data);
 				}
 			}
 		}
 
+		// sorts posting lists and drops duplicates coming from the data loaded multiple times,
+		// data added after this call gets a new index even if it has already been loaded
+		void freeze(void) {
+			for (auto it = m_map.begin(); it != m_map.end(); ++it) {
+				auto &data = it->second.data;
+
+				std::stable_sort(data.begin(), data.end());
+				data.erase(std::unique(data.begin(), data.end(),
+						[] (const ngram_index_data &a, const ngram_index_data &b) {
+							return a.data_index == b.data_index;
+						}), data.end());
+				data.shrink_to_fit();
+			}
+
+			std::map<D, size_t>().swap(m_data_index);
+			m_data.shrink_to_fit();
+
+			m_frozen = true;
+		}
+
+		// posting lists are sorted by data index only when index is frozen
+		bool frozen(void) const {
+			return m_frozen;
+		}
+
+		const ngram_meta *meta(const S &word) const {
+			auto it = m_map.find(word);
+			if (it == m_map.end())
+				return NULL;
+
+			return &it->second;
+		}
+
+		const D &data(size_t index) const {
+			return m_data[index];
+		}
+
 		std::vector<ngram_data> lookup_word(const S &word) const {
 			std::vector<ngram_data> ret;
 
@@ -143,6 +186,7 @@ class ngram {
 
 	private:
 		int m_n;
+		bool m_frozen;
 		std::map<S, ngram_meta> m_map;
 		std::vector<D> m_data;
 		std::map<D, size_t> m_data_index;
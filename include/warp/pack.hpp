@@ -17,11 +17,18 @@
 #ifndef __IOREMAP_WARP_PACK_HPP
 #define __IOREMAP_WARP_PACK_HPP
 
+#include "block.hpp"
+#include "column.hpp"
+#include "decode.hpp"
 #include "feature.hpp"
+#include "queue.hpp"
 
+#include <algorithm>
 #include <atomic>
+#include <cstdio>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <sstream>
 #include <thread>
@@ -31,171 +38,787 @@
 
 #include <boost/lexical_cast.hpp>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 namespace ioremap { namespace warp {
 
+/*
+ * Serializes records into a single reusable buffer and writes it to the file in large blocks,
+ * every write except the last one is a multiple of block_size at block aligned file offset.
+ */
+class shard_writer {
+	public:
+		enum {
+			block_size = 1024 * 1024,
+			flush_size = 8 * block_size
+		};
+
+		shard_writer() : m_fd(-1), m_written(0), m_pk(m_buf) {
+			m_buf.data.reserve(flush_size + block_size);
+		}
+
+		shard_writer(const shard_writer &) = delete;
+
+		~shard_writer() {
+			if (m_fd >= 0)
+				::close(m_fd);
+		}
+
+		// all methods return 0 or negative error code
+		int open(const std::string &name) {
+			m_fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			if (m_fd < 0)
+				return -errno;
+
+			return 0;
+		}
+
+		int add(const parsed_word &rec) {
+			m_pk.pack(rec);
+			return flush();
+		}
+
+		// appends raw bytes
+		int append(const char *ptr, size_t size) {
+			m_buf.write(ptr, size);
+			return flush();
+		}
+
+		// number of bytes added so far, the next record starts at this file offset
+		uint64_t offset(void) const {
+			return m_written + m_buf.data.size();
+		}
+
+		int close(void) {
+			int err = write(m_buf.data.data(), m_buf.data.size());
+			m_buf.data.clear();
+
+			if (::close(m_fd) < 0 && !err)
+				err = -errno;
+			m_fd = -1;
+
+			return err;
+		}
+
+		// msgpack stream
+		struct buffer {
+			std::string data;
+
+			void write(const char *ptr, size_t size) {
+				data.append(ptr, size);
+			}
+		};
+
+	private:
+		int m_fd;
+		uint64_t m_written;
+		buffer m_buf;
+		msgpack::packer<buffer> m_pk;
+
+		int flush(void) {
+			if (m_buf.data.size() < flush_size)
+				return 0;
+
+			size_t aligned = m_buf.data.size() / block_size * block_size;
+			int err = write(m_buf.data.data(), aligned);
+			m_buf.data.erase(0, aligned);
+			return err;
+		}
+
+		int write(const char *ptr, size_t size) {
+			while (size) {
+				ssize_t written = ::write(m_fd, ptr, size);
+				if (written < 0) {
+					if (errno == EINTR)
+						continue;
+					return -errno;
+				}
+
+				ptr += written;
+				size -= written;
+				m_written += written;
+			}
+
+			return 0;
+		}
+};
+
+/*
+ * Groups dictionary records by lemma and writes them into @output_num msgpack files,
+ * lemmas are sorted and all records of the same lemma are written into the same file
+ * in the order they were added.
+ *
+ * Records are accumulated in memory until @memory_limit bytes are used, then they are sorted
+ * and spilled into a temporary run file next to the output, lemmas of evenly spaced records
+ * of the run are kept in memory together with their file offsets. finish() picks lemmas which split
+ * these samples into @output_num equal parts, every output file gets its own lemma range which
+ * is merged from all runs and written by its own thread. Temporary files are removed at the end.
+ *
+ * Output files are either streams of msgpack records or columnar files (see column.hpp),
+ * both can be put into block-compressed container (see block.hpp). Temporary run files
+ * are always uncompressed msgpack.
+ */
 class packer {
 	public:
-		packer(const std::string &output, int output_num) : m_output_base(output), m_output_num(output_num) {
+		enum output_format {
+			format_msgpack = 0,
+			format_columnar
+		};
+
+		enum {
+			// run index keeps every index_step-th record, but at least index_samples records of every run
+			index_step = 1024,
+			index_samples = 64
+		};
+
+		packer(const std::string &output, int output_num, size_t memory_limit = 256 * 1024 * 1024,
+				output_format format = format_columnar, bool compress = false) :
+			m_output_base(output), m_output_num(output_num), m_memory_limit(memory_limit),
+			m_format(format), m_compress(compress), m_memory(0), m_total(0), m_error(0), m_finished(false) {
 		}
 
 		packer(const packer &z) = delete;
+
 		~packer() {
-			std::ofstream out;
-
-			int file_id = 0;
-			size_t num = 0;
-			size_t step = m_roots.size() / m_output_num + 1;
-
-			for (auto root = m_roots.begin(); root != m_roots.end(); ++root) {
-				if (!out.good() || !out.is_open()) {
-					std::string name = m_output_base + "." + boost::lexical_cast<std::string>(file_id);
-					out.open(name.c_str(), std::ios::binary | std::ios::trunc);
-					if (!out.good()) {
-						std::cerr << "Could not open output file '" << name << "': " << -errno << std::endl;
-						return;
-					}
+			if (!m_finished)
+				finish();
+		}
+
+		bool zprocess(const struct parsed_word &rec) {
+			if (m_error)
+				return false;
+
+			m_buffer.push_back(rec);
+			m_memory += record_memory(rec);
+			m_total++;
+
+			if (m_memory >= m_memory_limit)
+				spill();
 
-					std::cout << "Using '" << name << "' output file" << std::endl;
+			return m_error == 0;
+		}
+
+		// writes output files, returns 0 or negative error code, error is also printed to stderr
+		int finish(void) {
+			if (m_finished)
+				return m_error;
+			m_finished = true;
+
+			if (!m_error)
+				merge();
+
+			for (auto run = m_runs.begin(); run != m_runs.end(); ++run)
+				std::remove(run->name.c_str());
+			m_runs.clear();
+
+			return m_error;
+		}
+
+	private:
+		std::string m_output_base;
+		int m_output_num;
+		size_t m_memory_limit;
+		output_format m_format;
+		bool m_compress;
+
+		std::vector<parsed_word> m_buffer;
+		size_t m_memory;
+		size_t m_total;
+
+		// sorted temporary file, lemma and offset of every @step-th record are kept in the index
+		struct run_file {
+			std::string name;
+			size_t step;
+			std::vector<std::pair<std::string, uint64_t>> index;
+		};
+
+		std::vector<run_file> m_runs;
+
+		int m_error;
+		bool m_finished;
+
+		static size_t record_memory(const parsed_word &rec) {
+			return sizeof(rec) + rec.lemma.capacity() + rec.word.capacity();
+		}
+
+		// @err is negative error code
+		void set_error(const std::string &message, const std::string &name, int err) {
+			std::cerr << message << " '" << name << "': " << strerror(-err) << ": " << err << std::endl;
+			m_error = err;
+		}
+
+		// records of the same lemma keep their order
+		void sort_buffer(void) {
+			std::stable_sort(m_buffer.begin(), m_buffer.end(), [] (const parsed_word &a, const parsed_word &b) {
+					return a.lemma < b.lemma;
+				});
+		}
+
+		void spill(void) {
+			std::string name = m_output_base + ".run." + boost::lexical_cast<std::string>(m_runs.size());
+
+			sort_buffer();
+
+			shard_writer out;
+			int err = out.open(name);
+			if (err) {
+				set_error("Could not open temporary run file", name, err);
+				return;
+			}
+
+			m_runs.emplace_back();
+			run_file &run = m_runs.back();
+			run.name = name;
+			run.step = sample_step(m_buffer.size());
+
+			for (size_t i = 0; i < m_buffer.size() && !err; ++i) {
+				if (i % run.step == 0)
+					run.index.emplace_back(m_buffer[i].lemma, out.offset());
+				err = out.add(m_buffer[i]);
+			}
+
+			if (!err)
+				err = out.close();
+			if (err) {
+				set_error("Could not write to temporary run file", name, err);
+				return;
+			}
+
+			std::cout << "Spilled " << m_buffer.size() << " records into '" << name << "'" << std::endl;
+
+			std::vector<parsed_word>().swap(m_buffer);
+			m_memory = 0;
+		}
+
+		// output file with records whose lemmas are in [@lo, @hi), NULL means there is no bound
+		struct output_shard {
+			std::string name;
+			const std::string *lo, *hi;
+			int error;
+			std::string message;
+
+			output_shard() : lo(NULL), hi(NULL), error(0) {}
+		};
+
+		// records of one lemma range of the sorted run file or of the in-memory buffer
+		struct run_source {
+			std::vector<parsed_word> *mem;
+			size_t pos, end;
+
+			std::unique_ptr<msgpack_reader> reader;
+			const std::string *hi;
+			bool done;
+
+			parsed_word cur;
+			parsed_word_view view;
+
+			run_source() : mem(NULL), pos(0), end(0), hi(NULL), done(false) {}
+
+			// returns false when there are no more records in the range, throws on corrupted data
+			bool next(void) {
+				if (mem) {
+					if (pos == end)
+						return false;
+					cur = std::move((*mem)[pos++]);
+					return true;
 				}
 
-				bool ret = pack(out, root->second);
-				if (!ret) {
-					std::string name = m_output_base + boost::lexical_cast<std::string>(file_id);
-					std::cerr << "Could not write to output file '" << name << "': " << -errno << std::endl;
-					return;
+				if (done || reader->empty())
+					return false;
+
+				decode_record(*reader, view);
+				if (hi && view.lemma.compare(*hi) >= 0) {
+					done = true;
+					return false;
+				}
+
+				view.copy(cur);
+				return true;
+			}
+		};
+
+		static size_t sample_step(size_t records) {
+			return std::max<size_t>(1, std::min<size_t>(index_step, records / index_samples));
+		}
+
+		// lemmas which start output files after the first one, every file gets about the same number of records
+		std::vector<std::string> split_points(void) const {
+			// sampled lemma and the number of records it stands for
+			std::vector<std::pair<const std::string *, size_t>> samples;
+
+			if (m_runs.empty()) {
+				size_t step = sample_step(m_buffer.size());
+				for (size_t i = 0; i < m_buffer.size(); i += step)
+					samples.emplace_back(&m_buffer[i].lemma, step);
+			} else {
+				for (auto run = m_runs.begin(); run != m_runs.end(); ++run) {
+					for (auto idx = run->index.begin(); idx != run->index.end(); ++idx)
+						samples.emplace_back(&idx->first, run->step);
 				}
+			}
 
-				if (++num >= step) {
-					out.close();
-					num = 0;
+			std::vector<std::string> ret;
+			if (samples.empty())
+				return ret;
+
+			std::sort(samples.begin(), samples.end(), [] (const std::pair<const std::string *, size_t> &a,
+						const std::pair<const std::string *, size_t> &b) {
+					return *a.first < *b.first;
+				});
+
+			size_t total = 0;
+			for (auto smp = samples.begin(); smp != samples.end(); ++smp)
+				total += smp->second;
+
+			// ranges must not be empty, so split lemmas are strictly increasing and the first lemma is never used
+			size_t seen = 0;
+			int file_id = 1;
+			for (auto smp = samples.begin(); smp != samples.end() && file_id < m_output_num; ++smp) {
+				if (seen >= total * file_id / m_output_num) {
+					if (*smp->first > (ret.empty() ? *samples.front().first : ret.back()))
+						ret.push_back(*smp->first);
 					++file_id;
 				}
+
+				seen += smp->second;
 			}
+
+			return ret;
 		}
 
-		bool zprocess(const struct parsed_word &rec) {
-			auto r = m_roots.find(rec.lemma);
-			if (r == m_roots.end()) {
-				std::vector<parsed_word> vec;
-				vec.push_back(rec);
+		// merges all records of the @shard range from all runs and writes them, runs in its own thread
+		void merge_shard(output_shard &shard, const std::vector<std::unique_ptr<mapped_file>> &files) {
+			try {
+				std::vector<std::unique_ptr<run_source>> sources;
+
+				auto before = [] (const std::string &lemma, const std::string *bound) {
+					return bound && lemma < *bound;
+				};
+
+				if (m_runs.empty()) {
+					auto less = [] (const parsed_word &rec, const std::string &lemma) {
+						return rec.lemma < lemma;
+					};
+
+					std::unique_ptr<run_source> src(new run_source);
+					src->mem = &m_buffer;
+					src->pos = shard.lo ? std::lower_bound(m_buffer.begin(), m_buffer.end(), *shard.lo, less) - m_buffer.begin() : 0;
+					src->end = shard.hi ? std::lower_bound(m_buffer.begin(), m_buffer.end(), *shard.hi, less) - m_buffer.begin() :
+						m_buffer.size();
+					sources.emplace_back(std::move(src));
+				}
 
-				m_roots[rec.lemma] = vec;
-			} else {
-				r->second.emplace_back(rec);
+				for (size_t i = 0; i < m_runs.size(); ++i) {
+					const run_file &run = m_runs[i];
+
+					// starts at the last sampled record before the range, records of the same lemma are contiguous
+					uint64_t offset = 0;
+					for (auto idx = run.index.begin(); idx != run.index.end() && before(idx->first, shard.lo); ++idx)
+						offset = idx->second;
+
+					std::unique_ptr<run_source> src(new run_source);
+					src->reader.reset(new msgpack_reader(files[i]->data() + offset, files[i]->size() - offset));
+					src->hi = shard.hi;
+					sources.emplace_back(std::move(src));
+				}
+
+				// min-heap of sources ordered by their current lemma, ties are resolved by run order
+				auto greater = [&] (size_t a, size_t b) {
+					int cmp = sources[a]->cur.lemma.compare(sources[b]->cur.lemma);
+					return cmp > 0 || (cmp == 0 && a > b);
+				};
+
+				std::vector<size_t> heap;
+				for (size_t i = 0; i < sources.size(); ++i) {
+					bool have;
+					do {
+						have = sources[i]->next();
+					} while (have && before(sources[i]->cur.lemma, shard.lo));
+
+					if (have)
+						heap.push_back(i);
+				}
+				std::make_heap(heap.begin(), heap.end(), greater);
+
+				shard_writer out;
+				column_writer columns;
+				block_writer<shard_writer> blocks(out);
+
+				shard_writer::buffer record;
+				msgpack::packer<shard_writer::buffer> pk(record);
+
+				shard.error = out.open(shard.name);
+				if (!shard.error && m_format == format_columnar)
+					shard.error = columns.open(shard.name + ".columns");
+
+				while (!heap.empty() && !shard.error) {
+					std::pop_heap(heap.begin(), heap.end(), greater);
+					run_source &src = *sources[heap.back()];
+
+					if (m_format == format_columnar) {
+						shard.error = columns.add(src.cur);
+					} else if (m_compress) {
+						record.data.clear();
+						pk.pack(src.cur);
+						shard.error = blocks.add(record.data.data(), record.data.size());
+					} else {
+						shard.error = out.add(src.cur);
+					}
+
+					if (src.next())
+						std::push_heap(heap.begin(), heap.end(), greater);
+					else
+						heap.pop_back();
+				}
+
+				if (!shard.error && m_format == format_columnar) {
+					if (m_compress)
+						shard.error = columns.write(blocks);
+					else
+						shard.error = columns.write(out);
+				}
+				if (!shard.error && m_compress)
+					shard.error = blocks.finish();
+				if (!shard.error)
+					shard.error = out.close();
+			} catch (const std::exception &e) {
+				shard.message = e.what();
+				shard.error = -EIO;
 			}
-			return true;
 		}
 
-	private:
-		std::map<std::string, std::vector<parsed_word>> m_roots;
-		std::string m_output_base;
-		int m_output_num;
+		void merge(void) {
+			if (m_runs.empty()) {
+				sort_buffer();
+			} else if (m_buffer.size()) {
+				spill();
+				if (m_error)
+					return;
+			}
 
-		bool pack(std::ofstream &out, const std::vector<parsed_word> &words) {
-			for (auto word = words.begin(); word != words.end(); ++word) {
-				msgpack::sbuffer buf;
-				msgpack::pack(&buf, *word);
+			if (!m_total)
+				return;
 
-				out.write(buf.data(), buf.size());
-				if (!out.good())
-					return false;
+			std::vector<std::unique_ptr<mapped_file>> files;
+			for (auto run = m_runs.begin(); run != m_runs.end(); ++run) {
+				try {
+					files.emplace_back(new mapped_file(run->name));
+				} catch (const std::exception &e) {
+					std::cerr << "Could not open temporary run file: " << e.what() << std::endl;
+					m_error = -EIO;
+					return;
+				}
 			}
 
-			return true;
+			std::vector<std::string> splits = split_points();
+			std::vector<output_shard> shards(splits.size() + 1);
+
+			for (size_t i = 0; i < shards.size(); ++i) {
+				output_shard &sh = shards[i];
+				sh.name = m_output_base + "." + boost::lexical_cast<std::string>(i);
+				if (i > 0)
+					sh.lo = &splits[i - 1];
+				if (i < splits.size())
+					sh.hi = &splits[i];
+
+				std::cout << "Using '" << sh.name << "' output file" << std::endl;
+			}
+
+			std::vector<std::thread> pool;
+			try {
+				for (size_t i = 0; i < shards.size(); ++i)
+					pool.emplace_back(&packer::merge_shard, this, std::ref(shards[i]), std::cref(files));
+			} catch (const std::exception &e) {
+				std::cerr << "Could not start merge threads: " << e.what() << std::endl;
+				m_error = -EAGAIN;
+			}
+
+			for (auto th = pool.begin(); th != pool.end(); ++th)
+				th->join();
+			if (m_error)
+				return;
+
+			for (auto sh = shards.begin(); sh != shards.end(); ++sh) {
+				if (sh->message.size()) {
+					std::cerr << "Could not merge temporary run files into '" << sh->name << "': " << sh->message << std::endl;
+					m_error = sh->error;
+				} else if (sh->error) {
+					set_error("Could not write to output file", sh->name, sh->error);
+				}
+			}
 		}
 };
 
+/*
+ * Reads dictionary files in parallel.
+ *
+ * Files are split into chunks of about chunk_size bytes which start and end at record boundaries:
+ * columnar files are split by record number, msgpack files are scanned for record boundaries,
+ * every block of the block-compressed msgpack file is a chunk and it is decompressed by the thread
+ * which decodes it. Block-compressed columnar files are decompressed in parallel while being opened.
+ * Chunks are split between threads so that every thread gets about the same number of bytes,
+ * a thread which has finished its chunks steals them from others. Load time does not depend on
+ * the number and sizes of the files this way.
+ *
+ * Files are mapped and records are decoded in place, parsed_word_view passed to the callback
+ * points into the mapping and is valid only until the callback returns. Callback which takes
+ * parsed_word gets a per-thread record whose string buffers are reused. Callback index
+ * is the index of the thread which runs it, it is in [0, thread_num).
+ */
 class unpacker {
 	public:
+		typedef std::function<bool (int idx, const parsed_word_view &)> unpack_view_process;
 		typedef std::function<bool (int idx, const parsed_word &)> unpack_process;
- 
-		unpacker(const std::vector<std::string> &inputs, int thread_num, const unpack_process &process) : m_total(0) {
+
+		enum {
+			chunk_size = 4 * 1024 * 1024
+		};
+
+		unpacker(const std::vector<std::string> &inputs, int thread_num, const unpack_view_process &process) :
+			m_inputs(inputs.size()), m_thread_num(std::max(thread_num, 1)), m_total(0) {
 			timer t;
 
-			std::vector<std::thread> pool;
-			pool.reserve(thread_num);
+			thread_num = std::max(thread_num, 1);
 
-			for (int i = 0; i < thread_num; ++i) {
-				std::vector<std::string> in;
+			std::vector<std::vector<chunk>> chunks(inputs.size());
+			std::atomic_size_t next_input(0);
 
-				for (size_t j = i; j < inputs.size(); j += thread_num)
-					in.push_back(inputs[j]);
+			auto split = [&] () {
+				for (size_t i = next_input++; i < inputs.size(); i = next_input++) {
+					m_inputs[i].path = inputs[i];
+					chunks[i] = split_input(i);
+				}
+			};
 
-				pool.emplace_back(std::bind(&unpacker::unpack, this, i, in, process));
-			}
+			std::vector<std::thread> pool;
+			for (int i = 0; i < std::min<int>(thread_num, inputs.size()); ++i)
+				pool.emplace_back(split);
+			for (auto th = pool.begin(); th != pool.end(); ++th)
+				th->join();
+			pool.clear();
+
+			stealing_queue<chunk> queue(thread_num);
+			schedule(chunks, thread_num, queue);
 
+			for (int i = 0; i < thread_num; ++i)
+				pool.emplace_back(std::bind(&unpacker::unpack, this, i, std::ref(queue), std::cref(process)));
 			for (auto th = pool.begin(); th != pool.end(); ++th)
 				th->join();
 
 			std::cout << "Threads: " << thread_num <<
 				", read objects: " << m_total <<
 				", elapsed time: " << t.elapsed() << " msecs" <<
-				", speed: " << m_total * 1000 / t.elapsed() << " objs/sec" <<
+				", speed: " << m_total * 1000 / std::max(t.elapsed(), 1L) << " objs/sec" <<
 				std::endl;
 		}
 
+		unpacker(const std::vector<std::string> &inputs, int thread_num, const unpack_process &process) :
+			unpacker(inputs, thread_num, copy_process(std::max(thread_num, 1), process)) {
+		}
+
 	private:
+		struct input {
+			std::string path;
+			std::unique_ptr<mapped_file> file;
+			std::unique_ptr<column_reader> columns;
+			std::unique_ptr<block_reader> blocks;
+		};
+
+		// byte range of msgpack file, record range of columnar file or block range of compressed msgpack file
+		struct chunk {
+			size_t input;
+			size_t begin, end;
+			size_t bytes;
+		};
+
+		std::vector<input> m_inputs;
+		int m_thread_num;
 		std::atomic_long m_total;
 
-		void unpack(int idx, const std::vector<std::string> &inputs, const unpack_process &process) {
-			timer total, t;
+		static unpack_view_process copy_process(int thread_num, const unpack_process &process) {
+			std::shared_ptr<std::vector<parsed_word>> records = std::make_shared<std::vector<parsed_word>>(thread_num);
 
-			long num = 0;
-			long chunk = 100000;
-			long duration;
+			return [records, process] (int idx, const parsed_word_view &view) -> bool {
+				parsed_word &rec = (*records)[idx];
+				view.copy(rec);
+				return process(idx, rec);
+			};
+		}
+
+		// opens input file and splits it into chunks, errors are printed and the rest of the file is skipped
+		std::vector<chunk> split_input(size_t idx) {
+			input &in = m_inputs[idx];
+			std::vector<chunk> chunks;
+
+			std::ostringstream ss;
+			ss << "Opened file '" << in.path << "'\n";
+			std::cout << ss.str();
+
+			try {
+				if (block::is_block_file(in.path)) {
+					in.blocks.reset(new block_reader(in.path));
+
+					std::string first;
+					if (in.blocks->size())
+						in.blocks->read(0, first);
+
+					if (column::is_columnar(first.data(), first.size())) {
+						in.columns.reset(new column_reader(in.blocks->read_all(m_thread_num), in.path));
+						in.blocks.reset();
+					} else {
+						for (size_t i = 0; i < in.blocks->size(); ++i)
+							chunks.push_back(chunk{idx, i, i + 1, in.blocks->raw_size(i)});
+						return chunks;
+					}
+				} else if (column::is_columnar_file(in.path)) {
+					in.columns.reset(new column_reader(in.path));
+				}
+
+				if (in.columns) {
+					const size_t records = in.columns->size();
+					const size_t size = std::max<size_t>(in.columns->file_size(), 1);
+					const size_t step = std::max<size_t>(records * chunk_size / size, 1);
+
+					for (size_t begin = 0; begin < records; begin += step) {
+						chunk c;
+						c.input = idx;
+						c.begin = begin;
+						c.end = std::min(begin + step, records);
+						c.bytes = (c.end - c.begin) * size / records;
+						chunks.push_back(c);
+					}
+
+					return chunks;
+				}
+
+				in.file.reset(new mapped_file(in.path));
+
+				// only headers are parsed, string data is skipped
+				msgpack_reader reader(in.file->data(), in.file->size());
+				size_t begin = 0;
 
-			for (auto it = inputs.begin(); it != inputs.end(); ++it) {
 				try {
-					msgpack::unpacker pac;
+					while (!reader.empty()) {
+						reader.skip();
 
-					std::ifstream in(*it, std::ios::binary);
+						if (reader.offset() - begin >= chunk_size || reader.empty()) {
+							chunks.push_back(chunk{idx, begin, reader.offset(), reader.offset() - begin});
+							begin = reader.offset();
+						}
+					}
+				} catch (...) {
+					if (reader.offset() != begin)
+						chunks.push_back(chunk{idx, begin, reader.offset(), reader.offset() - begin});
+					throw;
+				}
+			} catch (const std::exception &e) {
+				std::cerr << "Exception: " << e.what() << std::endl;
+			}
 
-					std::ostringstream ss;
-					ss << "Opened file '" << *it << "'\n";
-					std::cout << ss.str();
+			return chunks;
+		}
+
+		// every thread gets a contiguous run of chunks with about the same number of bytes
+		static void schedule(std::vector<std::vector<chunk>> &chunks, int thread_num, stealing_queue<chunk> &queue) {
+			size_t total = 0;
+			for (auto file = chunks.begin(); file != chunks.end(); ++file) {
+				for (auto c = file->begin(); c != file->end(); ++c)
+					total += c->bytes;
+			}
 
-					while (true) {
-						pac.reserve_buffer(1024 * 1024);
-						size_t bytes = in.readsome(pac.buffer(), pac.buffer_capacity());
+			size_t bytes = 0;
+			for (auto file = chunks.begin(); file != chunks.end(); ++file) {
+				for (auto c = file->begin(); c != file->end(); ++c) {
+					int worker = total ? std::min<size_t>(bytes * thread_num / total, thread_num - 1) : 0;
+					bytes += c->bytes;
 
-						if (!bytes)
-							break;
-						pac.buffer_consumed(bytes);
+					queue.push(worker, std::move(*c));
+				}
+			}
+		}
 
-						msgpack::unpacked result;
-						while (pac.next(&result)) {
-							msgpack::object obj = result.get();
+		void unpack(int idx, stealing_queue<chunk> &queue, const unpack_view_process &process) {
+			timer total, t;
 
-							parsed_word e;
-							obj.convert<parsed_word>(&e);
+			long num = 0;
+			long step = 100000;
+			long duration;
 
-							if (!process(idx, e))
-								return;
+			auto emit = [&] (const parsed_word_view &e) -> bool {
+				if (!process(idx, e))
+					return false;
 
-							if ((++num % chunk) == 0) {
-								duration = t.restart();
-								std::cout << "Index: " << idx << ", read objects: " << num <<
-									", elapsed time: " << total.elapsed() << " msecs" <<
-									", speed: " << chunk * 1000 / duration << " objs/sec" <<
-									std::endl;
-							}
+				if ((++num % step) == 0) {
+					duration = t.restart();
+					std::cout << "Index: " << idx << ", read objects: " << num <<
+						", elapsed time: " << total.elapsed() << " msecs" <<
+						", speed: " << step * 1000 / std::max(duration, 1L) << " objs/sec" <<
+						std::endl;
+				}
 
-							++m_total;
-						}
-					}
+				++m_total;
+				return true;
+			};
 
+			chunk c;
+			std::string buffer;
+			while (queue.pop(idx, c)) {
+				try {
+					if (!unpack_chunk(c, buffer, emit))
+						break;
 				} catch (const std::exception &e) {
-					std::cerr << "Exception: " << e.what() << std::endl;
+					std::cerr << "Exception: " << m_inputs[c.input].path << ": " << e.what() << std::endl;
 				}
 			}
 
 			duration = total.elapsed();
 			std::cout << "Index: " << idx << ", read objects: " << num <<
 				", elapsed time: " << duration << " msecs" <<
-				", speed: " << num * 1000 / duration << " objs/sec" <<
+				", speed: " << num * 1000 / std::max(duration, 1L) << " objs/sec" <<
 				std::endl;
 
 		}
+
+		// @buffer holds decompressed block, records point into it
+		template <typename Emit>
+		bool unpack_chunk(const chunk &c, std::string &buffer, Emit &emit) {
+			const input &in = m_inputs[c.input];
+			parsed_word_view e;
+
+			// columnar files are not decoded, records are read directly from the mapped columns
+			if (in.columns) {
+				for (size_t i = c.begin; i < c.end; ++i) {
+					in.columns->get(i, e);
+					if (!emit(e))
+						return false;
+				}
+
+				return true;
+			}
+
+			const char *data;
+			size_t size;
+
+			if (in.blocks) {
+				in.blocks->read(c.begin, buffer);
+				data = buffer.data();
+				size = buffer.size();
+			} else {
+				data = in.file->data() + c.begin;
+				size = c.end - c.begin;
+			}
+
+			msgpack_reader reader(data, size);
+			while (!reader.empty()) {
+				decode_record(reader, e);
+
+				if (!emit(e))
+					return false;
+			}
+
+			return true;
+		}
 };
 
 }} // namespace ioremap::warp
@@ -210,7 +833,11 @@ static inline msgpack::packer<Stream> &operator <<(msgpack::packer<Stream> &o, c
 	o.pack((int)ioremap::warp::parsed_word::serialization_version);
 	o.pack(e.lemma);
 	o.pack(e.word);
-	o.pack(e.features);
+
+	o.pack_array(ioremap::warp::parsed_word::feature_mask::words);
+	for (size_t i = 0; i < ioremap::warp::parsed_word::feature_mask::words; ++i)
+		o.pack(e.features.w[i]);
+
 	o.pack(e.ending_len);
 
 	return o;
@@ -238,10 +865,45 @@ static inline ioremap::warp::parsed_word &operator >>(msgpack::object o, ioremap
 			throw std::runtime_error(ss.str());
 		}
 
+		uint64_t features;
+
+		p[1].convert(&e.lemma);
+		p[2].convert(&e.word);
+		p[3].convert(&features);
+		p[4].convert(&e.ending_len);
+
+		e.features = ioremap::warp::parsed_word::feature_mask(features);
+		break;
+	}
+	case 2: {
+		if (size != 5 || p[3].type != msgpack::type::ARRAY) {
+			std::ostringstream ss;
+			ss << "parsed_word msgpack: array size mismatch: read: " << size << ", must be: 5, " <<
+				"features type: " << p[3].type << ", must be: " << msgpack::type::ARRAY;
+			throw std::runtime_error(ss.str());
+		}
+
 		p[1].convert(&e.lemma);
 		p[2].convert(&e.word);
-		p[3].convert(&e.features);
 		p[4].convert(&e.ending_len);
+
+		// masks written with different width are accepted as long as all set bits fit
+		e.features = ioremap::warp::parsed_word::feature_mask();
+
+		const msgpack::object_array &words = p[3].via.array;
+		for (uint32_t i = 0; i < words.size; ++i) {
+			uint64_t w;
+			words.ptr[i].convert(&w);
+
+			if (i < ioremap::warp::parsed_word::feature_mask::words) {
+				e.features.w[i] = w;
+			} else if (w) {
+				std::ostringstream ss;
+				ss << "parsed_word msgpack: feature mask does not fit: read: " << words.size * 64 <<
+					" bits, supported: " << ioremap::warp::parsed_word::feature_mask::bits;
+				throw std::runtime_error(ss.str());
+			}
+		}
 		break;
 	}
 	default: {
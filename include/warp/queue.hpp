@@ -0,0 +1,226 @@
+/*
+ * Copyright 2014+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WARP_QUEUE_HPP
+#define __WARP_QUEUE_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ioremap { namespace warp {
+
+// multiple producers/multiple consumers queue, producers block when queue is full
+template <typename T>
+class bounded_queue {
+	public:
+		bounded_queue(size_t limit) : m_limit(limit), m_closed(false) {}
+
+		void push(T &&t) {
+			std::unique_lock<std::mutex> guard(m_lock);
+			m_can_push.wait(guard, [&] { return m_queue.size() < m_limit || m_closed; });
+
+			m_queue.emplace_back(std::move(t));
+			m_can_pop.notify_one();
+		}
+
+		// returns false when queue has been closed and there is nothing left in it
+		bool pop(T &t) {
+			std::unique_lock<std::mutex> guard(m_lock);
+			m_can_pop.wait(guard, [&] { return !m_queue.empty() || m_closed; });
+
+			if (m_queue.empty())
+				return false;
+
+			t = std::move(m_queue.front());
+			m_queue.pop_front();
+			m_can_push.notify_one();
+			return true;
+		}
+
+		void close(void) {
+			std::unique_lock<std::mutex> guard(m_lock);
+			m_closed = true;
+			m_can_pop.notify_all();
+			m_can_push.notify_all();
+		}
+
+	private:
+		size_t m_limit;
+		bool m_closed;
+		std::deque<T> m_queue;
+		std::mutex m_lock;
+		std::condition_variable m_can_push, m_can_pop;
+};
+
+/*
+ * Fixed set of work items split between workers, every worker has its own deque.
+ * Worker takes items from the front of its own deque and, when it is empty, steals from
+ * the back of other deques, so items which are close to each other are processed by the same worker.
+ * All items must be pushed before workers start popping.
+ */
+template <typename T>
+class stealing_queue {
+	public:
+		stealing_queue(int workers) : m_queues(std::max(workers, 1)) {}
+
+		void push(int worker, T &&t) {
+			m_queues[worker].items.emplace_back(std::move(t));
+		}
+
+		// returns false when there are no items left in any deque
+		bool pop(int worker, T &t) {
+			const int num = m_queues.size();
+
+			for (int i = 0; i < num; ++i) {
+				queue &q = m_queues[(worker + i) % num];
+
+				std::unique_lock<std::mutex> guard(q.lock);
+				if (q.items.empty())
+					continue;
+
+				if (i == 0) {
+					t = std::move(q.items.front());
+					q.items.pop_front();
+				} else {
+					t = std::move(q.items.back());
+					q.items.pop_back();
+				}
+
+				return true;
+			}
+
+			return false;
+		}
+
+	private:
+		struct queue {
+			std::deque<T> items;
+			std::mutex lock;
+		};
+
+		std::vector<queue> m_queues;
+};
+
+/*
+ * Processes items in parallel and hands results to the emit callback in the order items were pushed.
+ * Results are emitted from the thread which calls push() and finish(), push() blocks when
+ * @max_in_flight items are being processed or wait for their turn to be emitted, this bounds memory.
+ *
+ * Exception thrown by the work callback is rethrown from push() or finish() in place of its result.
+ */
+template <typename In, typename Out>
+class ordered_pipeline {
+	public:
+		typedef std::function<Out (In &)> work_process;
+		typedef std::function<void (Out &)> emit_process;
+
+		ordered_pipeline(int thread_num, size_t max_in_flight, const work_process &work, const emit_process &emit) :
+			m_max_in_flight(std::max<size_t>(max_in_flight, 1)), m_jobs(m_max_in_flight),
+			m_work(work), m_emit(emit), m_pushed(0), m_emitted(0)
+		{
+			for (int i = 0; i < std::max(thread_num, 1); ++i)
+				m_workers.emplace_back(std::bind(&ordered_pipeline::worker, this));
+		}
+
+		~ordered_pipeline() {
+			stop();
+		}
+
+		void push(In &&in) {
+			emit_ready(m_max_in_flight - 1);
+			m_jobs.push(std::make_pair(m_pushed++, std::move(in)));
+		}
+
+		// waits for all pushed items and emits them
+		void finish(void) {
+			m_jobs.close();
+			emit_ready(0);
+			stop();
+		}
+
+	private:
+		size_t m_max_in_flight;
+		bounded_queue<std::pair<size_t, In>> m_jobs;
+		work_process m_work;
+		emit_process m_emit;
+
+		std::vector<std::thread> m_workers;
+
+		std::mutex m_lock;
+		std::condition_variable m_ready;
+		std::map<size_t, std::pair<Out, std::exception_ptr>> m_done;
+		size_t m_pushed, m_emitted;
+
+		void worker(void) {
+			std::pair<size_t, In> job;
+			while (m_jobs.pop(job)) {
+				std::pair<Out, std::exception_ptr> res;
+				try {
+					res.first = m_work(job.second);
+				} catch (...) {
+					res.second = std::current_exception();
+				}
+
+				std::unique_lock<std::mutex> guard(m_lock);
+				m_done.emplace(job.first, std::move(res));
+				m_ready.notify_all();
+			}
+		}
+
+		// emits results in order until no more than @in_flight items are left unemitted
+		void emit_ready(size_t in_flight) {
+			std::unique_lock<std::mutex> guard(m_lock);
+
+			while (m_emitted < m_pushed) {
+				auto it = m_done.find(m_emitted);
+				if (it == m_done.end()) {
+					if (m_pushed - m_emitted <= in_flight)
+						break;
+
+					m_ready.wait(guard);
+					continue;
+				}
+
+				std::pair<Out, std::exception_ptr> res(std::move(it->second));
+				m_done.erase(it);
+				m_emitted++;
+
+				guard.unlock();
+				if (res.second)
+					std::rethrow_exception(res.second);
+				m_emit(res.first);
+				guard.lock();
+			}
+		}
+
+		void stop(void) {
+			m_jobs.close();
+			for (auto th = m_workers.begin(); th != m_workers.end(); ++th)
+				th->join();
+			m_workers.clear();
+		}
+};
+
+}} // namespace ioremap::warp
+
+#endif /* __WARP_QUEUE_HPP */
@@ -18,11 +18,16 @@
 #define __WARP_SPELL_HPP
 
 #include "warp/distance.hpp"
+#include "warp/frozen.hpp"
 #include "warp/fuzzy.hpp"
 #include "warp/ngram.hpp"
 #include "warp/pack.hpp"
+#include "warp/queue.hpp"
 #include "warp/timer.hpp"
 
+#include <set>
+#include <stdexcept>
+
 #include <msgpack.hpp>
 
 namespace ioremap { namespace warp {
@@ -64,24 +69,120 @@ namespace ioremap { namespace warp {
 
 	typedef std::shared_ptr<lemma_ctl> shared_lemma;
 
+	struct search_result {
+		std::vector<lemma_freq> lemmas;
+
+		// edit distance of the search stage which has found @lemmas, -1 if nothing was found
+		int distance;
+
+		// search budget has been exhausted, @lemmas are the best ones found before that
+		bool partial;
+
+		search_result() : distance(-1), partial(false) {}
+	};
+
 
 class spell {
 	public:
-		spell(int ngram) : m_thread_num(1) {
+		// dictionary is split into @thread_num partitions by lemma hash, every partition is built
+		// by its own thread, 0 means number of CPUs, freeze() merges forms of all partitions
+		// into a single exact-match table, so that a lookup probes one hash table
+		spell(int ngram, int thread_num = 0) : m_thread_num(thread_num), m_frozen(false), m_max_letters(0) {
+			if (m_thread_num <= 0)
+				m_thread_num = std::max(1U, std::thread::hardware_concurrency());
+
 			for (int i = 0; i < m_thread_num; ++i) {
 				m_search.emplace_back(lemma_search(ngram));
 			}
 		}
 
+		int thread_num(void) const {
+			return m_thread_num;
+		}
+
+		// words can only be fed before freeze(), throws otherwise
 		void feed_word(const std::string &word) {
-			m_search[0].feed_word(word);
+			check_not_frozen();
+			m_search[partition(word)].feed_word(word);
 		}
 
-		void feed_dict(const std::vector<std::string> &path) {
+		// loading pipeline: unpacker threads read dictionary records and route them in batches
+		// to the partition builders, then all partitions are frozen in parallel
+		// @tap is called for every record in the unpacker thread with index in [0, thread_num()),
+		// it allows to build other indexes within the same dictionary pass
+		void feed_dict(const std::vector<std::string> &path,
+				const unpacker::unpack_process &tap = unpacker::unpack_process()) {
+			check_not_frozen();
+
 			timer tm;
 
-			warp::unpacker(path, m_thread_num, std::bind(&spell::unpack_everything, this,
-						std::placeholders::_1, std::placeholders::_2));
+			typedef std::vector<parsed_word> batch;
+
+			std::vector<std::unique_ptr<bounded_queue<batch>>> queues;
+			for (int i = 0; i < m_thread_num; ++i)
+				queues.emplace_back(new bounded_queue<batch>(feed_queue_limit));
+
+			std::vector<std::thread> builders;
+
+			// builders are stopped and joined on every path, a joinable std::thread is never destroyed
+			auto stop_builders = [&] () {
+				for (auto q = queues.begin(); q != queues.end(); ++q)
+					(*q)->close();
+				for (auto th = builders.begin(); th != builders.end(); ++th)
+					th->join();
+			};
+
+			try {
+				for (int i = 0; i < m_thread_num; ++i) {
+					builders.emplace_back([this, i, &queues] () {
+							batch b;
+							while (queues[i]->pop(b)) {
+								for (auto e = b.begin(); e != b.end(); ++e)
+									unpack_everything(i, *e);
+							}
+						});
+				}
+
+				// pending batches indexed by unpacker thread and partition
+				std::vector<std::vector<batch>> pending(m_thread_num, std::vector<batch>(m_thread_num));
+
+				warp::unpacker(path, m_thread_num, [this, &pending, &queues, &tap] (int idx, const parsed_word_view &view) -> bool {
+							int part = partition(view.lemma);
+							batch &b = pending[idx][part];
+
+							// record is copied only once, directly into its batch
+							b.emplace_back();
+							view.copy(b.back());
+
+							if (tap && !tap(idx, b.back())) {
+								b.pop_back();
+								return false;
+							}
+
+							if (b.size() >= feed_batch_size) {
+								queues[part]->push(std::move(b));
+								b.clear();
+							}
+
+							return true;
+						});
+
+				for (int idx = 0; idx < m_thread_num; ++idx) {
+					for (int part = 0; part < m_thread_num; ++part) {
+						if (!pending[idx][part].empty())
+							queues[part]->push(std::move(pending[idx][part]));
+					}
+				}
+			} catch (...) {
+				stop_builders();
+				throw;
+			}
+
+			stop_builders();
+
+			long build_time = tm.elapsed();
+
+			freeze();
 
 			long words = 0, lemmas = 0;
 			for (int i = 0; i < m_thread_num; ++i) {
@@ -90,45 +191,339 @@ class spell {
 				lemmas += search.m_lemmas;
 			}
 
-			printf("spell checker loaded: words: %ld, lemmas: %ld, time: %lld ms\n",
-					words, lemmas, (unsigned long long)tm.elapsed());
+			printf("spell checker loaded: words: %ld, lemmas: %ld, partitions: %d, build time: %ld ms, time: %lld ms\n",
+					words, lemmas, m_thread_num, build_time, (unsigned long long)tm.elapsed());
 		}
 
-		std::vector<std::string> search(const std::string &text) {
-			timer tm;
-			std::vector<lemma_freq> ret;
+		// builds immutable exact-match tables and n-gram posting lists, nothing can be fed after this call
+		void freeze(void) {
+			if (m_frozen)
+				return;
+			m_frozen = true;
 
-			int min_dist = 2;
-			for (int i = 0; i < m_thread_num; ++i) {
-				auto tmp = m_search[i].search(text, min_dist);
-				ret.insert(ret.end(), tmp.begin(), tmp.end());
+			std::vector<std::thread> pool;
+			for (int i = 0; i < m_thread_num; ++i)
+				pool.emplace_back(std::bind(&lemma_search::freeze, &m_search[i]));
+
+			for (auto th = pool.begin(); th != pool.end(); ++th)
+				th->join();
+
+			std::set<unsigned int> alphabet;
+			for (int i = 0; i < m_thread_num; ++i)
+				alphabet.insert(m_search[i].m_alphabet.begin(), m_search[i].m_alphabet.end());
+			m_alphabet.assign(alphabet.begin(), alphabet.end());
+
+			build_forms();
+		}
+
+		// staged search: exact match, then distance 1 neighbourhood of the word probed in exact tables,
+		// then n-gram candidates verified with full edit distance,
+		// search stops at the first stage which finds anything or when @max_distance is reached
+		search_result lookup(const std::string &text, int max_distance = 2) const {
+			search_budget budget;
+			return lookup(text, max_distance, budget);
+		}
+
+		// candidate generation and verification stop when @budget is exhausted,
+		// dictionary must have been frozen, throws otherwise
+		search_result lookup(const std::string &text, int max_distance, search_budget &budget) const {
+			if (!m_frozen)
+				throw std::logic_error("spell: dictionary must be frozen before lookup");
+
+			search_result res;
+
+			res.lemmas = search_exact(text);
+			if (res.lemmas.size()) {
+				res.distance = 0;
+				return res;
+			}
+
+			std::string lower = boost::locale::to_lower(text, __fuzzy_locale);
+			if (lower != text) {
+				res.lemmas = search_exact(lower);
+				if (res.lemmas.size()) {
+					res.distance = 0;
+					return res;
+				}
 			}
 
+			if (max_distance < 1)
+				return res;
+
+			lstring t;
+			for (const char *ptr = lower.data(), *end = lower.data() + lower.size(); ptr < end;)
+				t.push_back(lconvert::next_utf8(ptr, end));
+
+			// a word longer than every dictionary form by 2 letters or more has no neighbours
+			if (t.size() <= m_max_letters + 1)
+				res.lemmas = search_neighbours(t, budget);
+			res.partial = budget.exceeded;
+			if (res.lemmas.size()) {
+				res.distance = 1;
+				return res;
+			}
+
+			if (max_distance < 2 || res.partial)
+				return res;
+
+			return search_fuzzy(t, max_distance, budget);
+		}
+
+		// n-gram stage of lookup() only, for callers which have already tried exact and distance 1 lookups
+		search_result lookup_fuzzy(const std::string &text, int max_distance, search_budget &budget) const {
+			if (!m_frozen)
+				throw std::logic_error("spell: dictionary must be frozen before lookup");
+
+			std::string lower = boost::locale::to_lower(text, __fuzzy_locale);
+
+			lstring t;
+			for (const char *ptr = lower.data(), *end = lower.data() + lower.size(); ptr < end;)
+				t.push_back(lconvert::next_utf8(ptr, end));
+
+			return search_fuzzy(t, max_distance, budget);
+		}
+
+		std::vector<std::string> search(const std::string &text) const {
+			timer tm;
+			search_result res = lookup(text);
+
 			std::vector<std::string> ret_str;
-			ret_str.reserve(ret.size());
+			ret_str.reserve(res.lemmas.size());
 
-			for (auto it = ret.begin(); it != ret.end(); ++it) {
+			for (auto it = res.lemmas.begin(); it != res.lemmas.end(); ++it) {
 				std::cout << text << ": " << it->lemma << " : count: " << it->count << ", distance: " << it->distance << std::endl;
 				ret_str.emplace_back(it->lemma);
 			}
 
-			printf("search: %s, found: %zd, total search time: %lld ms\n",
-					text.c_str(), ret_str.size(), (unsigned long long)tm.elapsed());
+			printf("search: %s, found: %zd, distance: %d, total search time: %lld ms\n",
+					text.c_str(), ret_str.size(), res.distance, (unsigned long long)tm.elapsed());
 
 			return ret_str;
 		}
 
 	private:
+		enum {
+			feed_batch_size = 4096,
+			feed_queue_limit = 64,
+		};
+
 		int m_thread_num;
+		bool m_frozen;
+
+		// all letters met in frozen dictionary words, used to build distance 1 neighbourhood
+		std::vector<unsigned int> m_alphabet;
+
+		// forms of all partitions, lemmas of the form with id @i are m_form_lemmas[m_form_offsets[i], m_form_offsets[i + 1]),
+		// the same form can refer to lemmas from several partitions
+		frozen_hash m_forms;
+		std::vector<uint32_t> m_form_offsets;
+		std::vector<shared_lemma> m_form_lemmas;
+
+		// letters in the longest form
+		size_t m_max_letters;
+
+		// records fed after freeze() would only be checked against the empty build-time map
+		// and would duplicate forms which are already in frozen tables
+		void check_not_frozen(void) const {
+			if (m_frozen)
+				throw std::logic_error("spell: dictionary can not be fed after it has been frozen");
+		}
+
+		int partition(const boost::string_ref &lemma) const {
+			return hash_bytes(lemma.data(), lemma.size(), 0) % m_thread_num;
+		}
+
+		// partition maps are sorted by form, they are merged into the single frozen table and released
+		void build_forms(void) {
+			typedef std::map<std::string, shared_lemma>::const_iterator form_iterator;
+
+			struct cursor {
+				form_iterator pos, end;
+				int part;
+			};
+
+			// min-heap of partition cursors ordered by form, ties are resolved by partition index
+			auto greater = [] (const cursor &a, const cursor &b) {
+				int cmp = a.pos->first.compare(b.pos->first);
+				return cmp > 0 || (cmp == 0 && a.part > b.part);
+			};
+
+			std::vector<cursor> heap;
+			size_t total = 0;
+			for (int i = 0; i < m_thread_num; ++i) {
+				const auto &forms = m_search[i].m_form2lemma;
+				if (!forms.empty())
+					heap.push_back(cursor{forms.begin(), forms.end(), i});
+				total += forms.size();
+			}
+			std::make_heap(heap.begin(), heap.end(), greater);
+
+			std::vector<std::string> keys;
+			keys.reserve(total);
+			m_form_lemmas.reserve(total);
+			m_form_offsets.reserve(total + 1);
+
+			while (!heap.empty()) {
+				std::pop_heap(heap.begin(), heap.end(), greater);
+				cursor &c = heap.back();
+
+				if (keys.empty() || keys.back() != c.pos->first) {
+					keys.push_back(c.pos->first);
+					m_form_offsets.push_back(m_form_lemmas.size());
+
+					const std::string &form = keys.back();
+					size_t letters = std::count_if(form.begin(), form.end(), [] (char ch) {
+							return ((unsigned char)ch & 0xc0) != 0x80;
+						});
+					m_max_letters = std::max(m_max_letters, letters);
+				}
+				m_form_lemmas.push_back(c.pos->second);
+
+				if (++c.pos != c.end)
+					std::push_heap(heap.begin(), heap.end(), greater);
+				else
+					heap.pop_back();
+			}
+			m_form_offsets.push_back(m_form_lemmas.size());
+
+			m_forms.build(keys);
+
+			for (int i = 0; i < m_thread_num; ++i)
+				std::map<std::string, shared_lemma>().swap(m_search[i].m_form2lemma);
+		}
+
+		static void add_ctl(std::vector<lemma_freq> &ret, const lemma_ctl &ctl, int distance) {
+			for (auto fr = ctl.freq.begin(); fr != ctl.freq.end(); ++fr) {
+				auto it = std::find_if(ret.begin(), ret.end(), [&] (const lemma_freq &r) {
+							return r.lemma == fr->lemma;
+						});
+				if (it != ret.end())
+					continue;
+
+				ret.push_back(*fr);
+				ret.back().distance = distance;
+			}
+		}
+
+		void add_lemmas(std::vector<lemma_freq> &ret, const std::string &word, int distance) const {
+			uint32_t id = m_forms.find(word);
+			if (id == frozen_hash::npos)
+				return;
+
+			for (uint32_t i = m_form_offsets[id]; i < m_form_offsets[id + 1]; ++i)
+				add_ctl(ret, *m_form_lemmas[i], distance);
+		}
+
+		std::vector<lemma_freq> search_exact(const std::string &word) const {
+			std::vector<lemma_freq> ret;
+			add_lemmas(ret, word, 0);
+			return ret;
+		}
+
+		// candidates of every partition verified with edit distance up to @max_distance, the closest ones are kept
+		search_result search_fuzzy(const lstring &t, int max_distance, search_budget &budget) const {
+			search_result res;
+
+			int min_dist = max_distance;
+			for (int i = 0; i < m_thread_num && !budget.exceeded; ++i) {
+				auto tmp = m_search[i].search_fuzzy(t, min_dist, budget);
+				res.lemmas.insert(res.lemmas.end(), tmp.begin(), tmp.end());
+			}
+
+			// partitions searched earlier could return candidates at larger distance
+			res.lemmas.erase(std::remove_if(res.lemmas.begin(), res.lemmas.end(), [min_dist] (const lemma_freq &fr) {
+						return fr.distance > min_dist;
+					}), res.lemmas.end());
+
+			if (res.lemmas.size())
+				res.distance = min_dist;
+
+			res.partial = budget.exceeded;
+			return res;
+		}
+
+		// every word at Damerau-Levenshtein distance 1 is probed in the exact-match table: for a word of L letters
+		// and alphabet of A letters met in the dictionary this is L deletions, L - 1 transpositions,
+		// (L + 1) * A insertions and L * A substitutions, about (2L + 1) * A single hash lookups,
+		// i.e. several hundreds to a couple of thousands, still cheaper than n-gram search and verification
+		std::vector<lemma_freq> search_neighbours(const lstring &t, search_budget &budget) const {
+			std::vector<lemma_freq> ret;
+
+			std::vector<std::string> letters(t.size());
+			for (size_t i = 0; i < t.size(); ++i)
+				lconvert::append_utf8(letters[i], t[i].l);
+
+			std::string word;
+			auto probe = [&] (size_t skip_from, size_t skip_to, const std::string &insert, size_t insert_at,
+					const std::string &insert2) {
+				if (!budget.spend())
+					return;
+
+				word.clear();
+				for (size_t i = 0; i <= t.size(); ++i) {
+					if (i == insert_at) {
+						word.append(insert);
+						word.append(insert2);
+					}
+					if (i < t.size() && (i < skip_from || i >= skip_to))
+						word.append(letters[i]);
+				}
+
+				add_lemmas(ret, word, 1);
+			};
+
+			const std::string empty;
+			std::string l;
+
+			for (size_t i = 0; i < t.size() && !budget.exceeded; ++i) {
+				// deletion
+				probe(i, i + 1, empty, t.size() + 1, empty);
+
+				// transposition
+				if (i + 1 < t.size() && !(t[i] == t[i + 1]))
+					probe(i, i + 2, letters[i + 1], i, letters[i]);
+			}
+
+			for (auto a = m_alphabet.begin(); a != m_alphabet.end() && !budget.exceeded; ++a) {
+				l.clear();
+				lconvert::append_utf8(l, *a);
+
+				for (size_t i = 0; i <= t.size() && !budget.exceeded; ++i) {
+					// insertion
+					probe(t.size(), t.size(), l, i, empty);
+
+					// substitution
+					if (i < t.size() && t[i].l != *a)
+						probe(i, i + 1, l, i, empty);
+				}
+			}
+
+			return ret;
+		}
 
 		struct lemma_search {
 			long m_words, m_lemmas;
 			fuzzy<shared_lemma> m_fuzzy;
+			// moved into the spell-wide frozen table by spell::freeze()
 			std::map<std::string, shared_lemma> m_form2lemma;
+			std::vector<unsigned int> m_alphabet;
 
 			lemma_search(int ngram) : m_words(0), m_lemmas(0), m_fuzzy(ngram) {
 			}
 
+			void freeze(void) {
+				m_fuzzy.freeze();
+
+				std::set<unsigned int> alphabet;
+				for (auto it = m_form2lemma.begin(); it != m_form2lemma.end(); ++it) {
+					const std::string &k = it->first;
+					for (const char *ptr = k.data(), *end = k.data() + k.size(); ptr < end;)
+						alphabet.insert(lconvert::next_utf8(ptr, end));
+				}
+
+				m_alphabet.assign(alphabet.begin(), alphabet.end());
+			}
+
 			std::map<std::string, shared_lemma>::iterator feed_word(const std::string &word) {
 				shared_lemma ctl = std::make_shared<lemma_ctl>();
 
@@ -146,39 +541,26 @@ class spell {
 				return it.first;
 			}
 
-			std::vector<lemma_freq> search(const std::string &text, int &min_dist) {
+			std::vector<lemma_freq> search_fuzzy(const lstring &t, int &min_dist, search_budget &budget) const {
 				timer tm;
-				std::vector<shared_lemma> ret;
-
-				auto precise = m_form2lemma.find(text);
-				if (precise != m_form2lemma.end()) {
-					min_dist = 0;
-
-					printf("spell checker lookup: '%s': precise search: elements: %zd, total words: %zd, search-time: %lld ms\n",
-							text.c_str(), precise->second->freq.size(), m_form2lemma.size(), (unsigned long long)tm.elapsed());
-					return precise->second->freq;
-				}
-
-				lstring t = lconvert::from_utf8(boost::locale::to_lower(text, __fuzzy_locale));
-				auto fsearch = m_fuzzy.search(t);
-
-				printf("spell checker lookup: rough search: words: %zd, min-dist: %d, fuzzy-search-time: %lld ms\n",
-						fsearch.size(), min_dist, (unsigned long long)tm.elapsed());
-
-				auto freq = search_everything(t, fsearch, min_dist);
-
-				printf("spell checker lookup: checked: words: %zd, total-search-time: %lld ms:\n",
-						freq.size(), (unsigned long long)tm.restart());
-
+				auto fsearch = m_fuzzy.search(t, min_dist, budget);
+
+				auto freq = search_everything(t, fsearch, min_dist, budget);
+#ifdef WARP_STDOUT_DEBUG
+				std::cout << "spell checker lookup: " << t << ": rough search: words: " << fsearch.size() <<
+					", checked: words: " << freq.size() << ", min-dist: " << min_dist <<
+					", search-time: " << tm.elapsed() << " ms" << std::endl;
+#endif
 				return freq;
 			}
 
-			std::vector<lemma_freq> search_everything(const lstring &t, const std::vector<shared_lemma> &fsearch, int &min_dist) {
+			std::vector<lemma_freq> search_everything(const lstring &t, const std::vector<shared_lemma> &fsearch, int &min_dist,
+					search_budget &budget) const {
 				std::vector<lemma_freq> ret;
 
 				ret.reserve(fsearch.size());
 
-				for (auto it = fsearch.begin(); it != fsearch.end(); ++it) {
+				for (auto it = fsearch.begin(); it != fsearch.end() && budget.spend(); ++it) {
 					for (auto w = (*it)->freq.begin(); w != (*it)->freq.end(); ++w) {
 						lstring word = lconvert::from_utf8(w->lemma);
 
@@ -195,8 +577,10 @@ class spell {
 						if (dist < min_dist)
 							ret.clear();
 
-						w->distance = dist;
-						ret.push_back(*w);
+						// lemma_freq is shared between all forms, result gets its own copy
+						lemma_freq fr = *w;
+						fr.distance = dist;
+						ret.push_back(fr);
 						min_dist = dist;
 					}
 				}
@@ -0,0 +1,272 @@
+/*
+ * Copyright 2014+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WARP_TAGS_HPP
+#define __WARP_TAGS_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace ioremap { namespace warp { namespace tags {
+
+struct tag_info {
+	const char	*name;
+	int		position;
+};
+
+/*
+ * Grammatical tags and their feature bit positions.
+ * Positions are never reused for different meanings, aliases share position of the main tag.
+ */
+static constexpr tag_info table[] = {
+	{ "им", 0 }, { "род", 1 }, { "дат", 2 }, { "вин", 3 }, { "твор", 4 }, { "пр", 5 },
+	{ "ед", 6 }, { "мн", 7 },
+	{ "неод", 8 }, { "од", 9 },
+	{ "полн", 10 }, { "кр", 11 },
+	{ "муж", 12 }, { "жен", 13 }, { "сред", 14 }, { "мж", 15 },
+	{ "устар", 16 },
+	{ "прич", 17 }, { "деепр", 18 },
+	{ "действ", 19 }, { "страд", 20 },
+	{ "имя", 21 }, { "отч", 22 }, { "фам", 23 },
+	{ "S", 24 }, { "A", 25 }, { "V", 26 }, { "PART", 27 }, { "PR", 28 }, { "CONJ", 29 }, { "INTJ", 30 },
+	{ "ADV", 31 }, { "PRDK", 32 }, { "SPRO", 33 }, { "COM", 34 }, { "APRO", 35 }, { "ANUM", 36 },
+	{ "ADVPRO", 31 }, { "NUM", 36 },
+	{ "наст", 37 }, { "прош", 38 }, { "буд", 39 },
+	{ "1", 40 }, { "2", 41 }, { "3", 42 },
+	{ "сов", 43 }, { "несов", 44 },
+	{ "сосл", 45 }, { "пов", 46 }, { "изъяв", 47 },
+	{ "гео", 48 },
+	{ "орг", 49 },
+	{ "срав", 50 }, { "прев", 51 },
+	{ "инф", 52 },
+	{ "притяж", 53 }, { "AOT_притяж", 53 },
+	{ "жарг", 54 },
+	{ "obsclite", 55 }, { "обсц", 55 },
+	// rare and service tags, they all share a single position
+	{ "weired", 56 }, { "непрош", 56 }, { "пе", 56 }, { "-", 56 }, { "л", 56 }, { "нп", 56 }, { "reserved", 56 },
+	{ "AOT_разг", 56 }, { "dsbl", 56 }, { "сокр", 56 }, { "парт", 56 }, { "вводн", 56 }, { "местн", 56 },
+	{ "редк", 56 }, { "AOT_ФРАЗ", 56 }, { "AOT_безл", 56 }, { "зват", 56 }, { "разг", 56 }, { "AOT_фраз", 56 },
+	{ "AOT_указат", 56 }, { "буфф", 56 },
+};
+
+static constexpr size_t count = sizeof(table) / sizeof(table[0]);
+
+constexpr bool equal(const char *a, const char *b)
+{
+	return *a == *b && (*a == '\0' || equal(a + 1, b + 1));
+}
+
+// position of the tag or -1 if it is unknown, usable in constant expressions
+constexpr int position(const char *name, size_t i = 0)
+{
+	return i == count ? -1 : equal(table[i].name, name) ? table[i].position : position(name, i + 1);
+}
+
+constexpr int max_position(size_t i = 0, int max = -1)
+{
+	return i == count ? max : max_position(i + 1, table[i].position > max ? table[i].position : max);
+}
+
+// number of distinct positions
+static constexpr int unique = max_position() + 1;
+
+/*
+ * Perfect hash: FNV-1a over the tag bytes with a seed, finalized and reduced to the number of slots.
+ * The seed is searched at compile time so that no two tags share a slot, lookup is a hash, a slot
+ * read and a single string comparison. Slot table and lookup are constexpr, so lookups of literal
+ * tag names are resolved at compile time. Hashes of NUL-terminated names and of (data, size) pairs
+ * must produce the same value.
+ */
+enum {
+	slots = 1024
+};
+
+constexpr uint32_t fnv(const char *s, uint32_t h)
+{
+	return *s ? fnv(s + 1, (h ^ (unsigned char)*s) * 16777619U) : h;
+}
+
+constexpr uint32_t finalize2(uint32_t h)
+{
+	return h ^ (h >> 12);
+}
+
+constexpr uint32_t finalize(uint32_t h)
+{
+	return finalize2((h ^ (h >> 15)) * 0x2c1b3c6dU);
+}
+
+constexpr uint32_t slot(const char *s, uint32_t seed)
+{
+	return finalize(fnv(s, seed)) % slots;
+}
+
+constexpr uint32_t fnv(const char *s, size_t size, uint32_t h)
+{
+	return size ? fnv(s + 1, size - 1, (h ^ (unsigned char)*s) * 16777619U) : h;
+}
+
+constexpr uint32_t slot(const char *s, size_t size, uint32_t seed)
+{
+	return finalize(fnv(s, size, seed)) % slots;
+}
+
+/*
+ * All pairs of tags are checked by splitting range of pair indexes [0, count * count) in halves,
+ * this keeps constexpr recursion depth logarithmic.
+ */
+constexpr bool distinct_name_pair(size_t i, size_t j)
+{
+	return i >= j || !equal(table[i].name, table[j].name);
+}
+
+constexpr bool distinct_names(size_t lo = 0, size_t hi = count * count)
+{
+	return hi - lo == 1 ? distinct_name_pair(lo / count, lo % count) :
+		distinct_names(lo, (lo + hi) / 2) && distinct_names((lo + hi) / 2, hi);
+}
+
+static_assert(distinct_names(), "grammatical tags must be unique");
+
+constexpr bool distinct_slot_pair(uint32_t seed, size_t i, size_t j)
+{
+	return i >= j || slot(table[i].name, seed) != slot(table[j].name, seed);
+}
+
+constexpr bool perfect(uint32_t seed, size_t lo = 0, size_t hi = count * count)
+{
+	return hi - lo == 1 ? distinct_slot_pair(seed, lo / count, lo % count) :
+		perfect(seed, lo, (lo + hi) / 2) && perfect(seed, (lo + hi) / 2, hi);
+}
+
+constexpr uint32_t find_seed(uint32_t seed)
+{
+	return perfect(seed) ? seed : find_seed(seed + 1);
+}
+
+static constexpr uint32_t seed = find_seed(2166136261U);
+
+constexpr size_t length(const char *s)
+{
+	return *s ? 1 + length(s + 1) : 0;
+}
+
+constexpr size_t max_length(size_t i = 0, size_t max = 0)
+{
+	return i == count ? max : max_length(i + 1, length(table[i].name) > max ? length(table[i].name) : max);
+}
+
+// longer names are rejected before they are hashed, this also bounds recursion depth of find()
+static constexpr size_t max_size = max_length();
+
+constexpr bool equal(const char *a, const char *b, size_t size)
+{
+	return !size || (*a == *b && equal(a + 1, b + 1, size - 1));
+}
+
+/*
+ * Slot -> tag index table is built at compile time, C++11 constexpr functions can not fill
+ * an array in a loop, so every slot is produced by its own call expanded from an index sequence.
+ */
+template <size_t... I>
+struct index_sequence {};
+
+template <typename A, typename B>
+struct concat_sequence;
+
+template <size_t... A, size_t... B>
+struct concat_sequence<index_sequence<A...>, index_sequence<B...>> {
+	typedef index_sequence<A..., (sizeof...(A) + B)...> type;
+};
+
+template <size_t N>
+struct make_index_sequence {
+	typedef typename concat_sequence<typename make_index_sequence<N / 2>::type,
+		typename make_index_sequence<N - N / 2>::type>::type type;
+};
+
+template <>
+struct make_index_sequence<0> {
+	typedef index_sequence<> type;
+};
+
+template <>
+struct make_index_sequence<1> {
+	typedef index_sequence<0> type;
+};
+
+static_assert(count < 0xff, "slot table can not address that many tags");
+
+struct tag_slot {
+	uint32_t	slot;
+	size_t		size;
+};
+
+struct tag_slots {
+	tag_slot	tag[count];
+};
+
+template <size_t... I>
+constexpr tag_slots make_tag_slots(index_sequence<I...>)
+{
+	return tag_slots{{ tag_slot{slot(table[I].name, seed), length(table[I].name)}... }};
+}
+
+// slot and name size of every tag
+static constexpr tag_slots tag_slot_table = make_tag_slots(make_index_sequence<count>::type());
+
+// index of the tag which lives in the slot @s or 0xff if the slot is empty
+constexpr uint8_t slot_tag(size_t s, size_t i = 0)
+{
+	return i == count ? 0xff : tag_slot_table.tag[i].slot == s ? i : slot_tag(s, i + 1);
+}
+
+struct slot_index {
+	uint8_t		tag[slots];
+};
+
+template <size_t... I>
+constexpr slot_index make_slot_index(index_sequence<I...>)
+{
+	return slot_index{{ slot_tag(I)... }};
+}
+
+static constexpr slot_index lookup_table = make_slot_index(make_index_sequence<slots>::type());
+
+constexpr int find_tag(uint8_t idx, const char *name, size_t size)
+{
+	return idx == 0xff || tag_slot_table.tag[idx].size != size || !equal(table[idx].name, name, size) ?
+		-1 : table[idx].position;
+}
+
+// returns position of the tag or -1 if it is unknown
+constexpr int find(const char *name, size_t size)
+{
+	return size > max_size ? -1 : find_tag(lookup_table.tag[slot(name, size, seed)], name, size);
+}
+
+constexpr int find(const char *name)
+{
+	return find(name, length(name));
+}
+
+static_assert(find("им") == position("им"), "hash lookup must agree with the tag table");
+static_assert(find("AOT_указат") == position("AOT_указат"), "hash lookup must agree with the tag table");
+static_assert(find("нет такого") == -1, "unknown tags must not be found");
+
+}}} // namespace ioremap::warp::tags
+
+#endif /* __WARP_TAGS_HPP */
@@ -0,0 +1,474 @@
+/*
+ * Copyright 2014+ Evgeniy Polyakov <zbr@ioremap.net>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WARP_TOKENIZER_HPP
+#define __WARP_TOKENIZER_HPP
+
+#include "warp/lstring.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <boost/locale.hpp>
+
+namespace ioremap { namespace warp {
+
+enum token_class {
+	token_word	= 1 << 0,	// contains at least one letter
+	token_number	= 1 << 1,	// digits (with separators)
+	token_space	= 1 << 2,
+	token_punct	= 1 << 3,
+};
+
+struct token {
+	uint32_t	offset;
+	uint32_t	size;
+	int		cls;
+
+	token() : offset(0), size(0), cls(0) {}
+	token(uint32_t offset, uint32_t size, int cls) : offset(offset), size(size), cls(cls) {}
+};
+
+/*
+ * Word tokenizer for UTF-8 text, it is a much faster replacement of boost::locale (ICU)
+ * word boundary analysis for the scripts it knows about: Latin, Cyrillic, Greek,
+ * digits, spaces and common punctuation. Its rules follow the word boundary rules
+ * ICU uses for these scripts: letters and digits make words, letters may be joined by
+ * an apostrophe or a dot, digits may be joined by a dot or a comma, underscore
+ * joins everything, combining marks stick to the preceding character, every
+ * punctuation character is a token on its own.
+ *
+ * Runs of ASCII letters/digits and two-byte Cyrillic letters are scanned with SSE2
+ * 16 bytes at a time. Runs of characters from the other scripts are collected and
+ * handed to ICU in a single pass at the end of the call.
+ *
+ * Tokens do not copy the text, they are (offset, size, class) triples.
+ */
+class tokenizer {
+	public:
+		tokenizer(const std::locale &loc = __fuzzy_locale) : m_loc(loc) {}
+
+		// appends to @tokens all tokens whose class is in @mask
+		void tokenize(const char *text, size_t size, std::vector<token> &tokens,
+				int mask = token_word | token_number) const {
+			const char *ptr = text;
+			const char *end = text + size;
+
+			size_t first = tokens.size();
+			std::vector<std::pair<const char *, const char *>> icu_runs;
+
+			while (ptr < end) {
+				const char *start = ptr;
+				const char *next = ptr;
+				int cls = char_class(next, end);
+
+				switch (cls) {
+				case cc_space:
+					ptr = next;
+					while (ptr < end) {
+						next = ptr;
+						if (char_class(next, end) != cc_space)
+							break;
+						ptr = next;
+					}
+
+					push(tokens, mask, text, start, ptr, token_space);
+					break;
+				case cc_letter:
+				case cc_digit:
+				case cc_extendnumlet: {
+					int tcls = scan_word(ptr, end);
+					push(tokens, mask, text, start, ptr, tcls);
+					break;
+				}
+				case cc_other:
+					// words of the same unknown script separated by spaces are handed to ICU at once
+					ptr = next;
+					for (const char *run = next; run < end;) {
+						int c = char_class(run, end);
+						if (c == cc_other || c == cc_extend)
+							ptr = run;
+						else if (c != cc_space)
+							break;
+					}
+
+					icu_runs.emplace_back(start, ptr);
+					break;
+				default:
+					// punctuation and orphan combining marks
+					ptr = next;
+					while (ptr < end) {
+						next = ptr;
+						if (char_class(next, end) != cc_extend)
+							break;
+						ptr = next;
+					}
+
+					push(tokens, mask, text, start, ptr, token_punct);
+					break;
+				}
+			}
+
+			if (!icu_runs.empty())
+				icu_tokenize(text, icu_runs, tokens, first, mask);
+		}
+
+		std::vector<token> tokenize(const std::string &text, int mask = token_word | token_number) const {
+			std::vector<token> tokens;
+			tokenize(text.data(), text.size(), tokens, mask);
+			return tokens;
+		}
+
+		// convenience helper which copies tokens into strings
+		std::vector<std::string> split(const std::string &text, int mask = token_word | token_number) const {
+			std::vector<token> tokens;
+			tokenize(text.data(), text.size(), tokens, mask);
+
+			std::vector<std::string> ret;
+			ret.reserve(tokens.size());
+			for (auto t = tokens.begin(); t != tokens.end(); ++t)
+				ret.emplace_back(text.data() + t->offset, t->size);
+
+			return ret;
+		}
+
+	private:
+		std::locale m_loc;
+
+		enum {
+			cc_other = 0,
+			cc_letter,
+			cc_digit,
+			cc_space,
+			cc_punct,
+			cc_midletter,		// joins letters
+			cc_midnum,		// joins digits
+			cc_midnumlet,		// joins letters or digits
+			cc_extendnumlet,	// joins everything
+			cc_extend,		// combining marks
+		};
+
+		static void push(std::vector<token> &tokens, int mask, const char *text, const char *start, const char *end, int cls) {
+			if (cls & mask)
+				tokens.push_back(token(start - text, end - start, cls));
+		}
+
+		struct ascii_table {
+			unsigned char cls[128];
+
+			ascii_table() {
+				for (int c = 0; c < 128; ++c) {
+					if (isalpha(c))
+						cls[c] = cc_letter;
+					else if (isdigit(c))
+						cls[c] = cc_digit;
+					else if (isspace(c))
+						cls[c] = cc_space;
+					else if (c < 0x20 || c == 0x7f)
+						cls[c] = cc_space;
+					else
+						cls[c] = cc_punct;
+				}
+
+				cls[(int)'\''] = cc_midnumlet;
+				cls[(int)'.'] = cc_midnumlet;
+				cls[(int)','] = cc_midnum;
+				cls[(int)';'] = cc_midnum;
+				cls[(int)'_'] = cc_extendnumlet;
+			}
+		};
+
+		static const unsigned char *ascii_classes(void) {
+			static const ascii_table table;
+			return table.cls;
+		}
+
+		static int unicode_class(unsigned int c) {
+			if (c < 0xc0) {
+				if (c == 0xa0)
+					return cc_space;
+				if (c == 0xaa || c == 0xb5 || c == 0xba)
+					return cc_letter;
+				if (c == 0xb7)
+					return cc_midletter;
+				if (c == 0xad)
+					return cc_extend;
+				if (c < 0xa0)
+					return cc_space;
+				return cc_punct;
+			}
+			if (c < 0x300)
+				return (c == 0xd7 || c == 0xf7) ? cc_punct : cc_letter;
+			if (c < 0x370)
+				return cc_extend;
+			if (c < 0x400)
+				return (c == 0x37e || c == 0x387) ? cc_punct : cc_letter;
+			if (c < 0x530) {
+				if (c == 0x482)
+					return cc_punct;
+				if (c >= 0x483 && c <= 0x489)
+					return cc_extend;
+				return cc_letter;
+			}
+			if (c >= 0x1d00 && c < 0x1dc0)
+				return cc_letter;
+			if (c >= 0x1dc0 && c < 0x1e00)
+				return cc_extend;
+			if (c >= 0x1e00 && c < 0x2000)
+				return cc_letter;
+			if (c >= 0x2000 && c < 0x2070) {
+				if (c <= 0x200a || c == 0x2028 || c == 0x2029 || c == 0x202f || c == 0x205f)
+					return cc_space;
+				if (c >= 0x200b && c <= 0x200f)
+					return cc_extend;
+				if (c == 0x2018 || c == 0x2019 || c == 0x2024)
+					return cc_midnumlet;
+				if (c == 0x2027)
+					return cc_midletter;
+				if (c >= 0x2060 && c <= 0x206f)
+					return cc_extend;
+				return cc_punct;
+			}
+			if (c >= 0x20a0 && c < 0x20d0)
+				return cc_punct;
+			if (c >= 0x20d0 && c < 0x2100)
+				return cc_extend;
+			if (c >= 0x2100 && c < 0x2c00)
+				return cc_punct;
+			if (c >= 0x2e00 && c < 0x2e80)
+				return cc_punct;
+			if (c == 0x3000)
+				return cc_space;
+			if (c == 0xfeff)
+				return cc_extend;
+			if (c >= 0xfe20 && c < 0xfe30)
+				return cc_extend;
+
+			return cc_other;
+		}
+
+		// classifies character at @ptr and moves @ptr past it
+		static int char_class(const char *&ptr, const char *end) {
+			unsigned char c = *ptr;
+			if (c < 0x80) {
+				++ptr;
+				return ascii_classes()[c];
+			}
+
+			return unicode_class(lconvert::next_utf8(ptr, end));
+		}
+
+		// skips ASCII letters and digits, returns true if any letter was skipped
+		static bool skip_ascii_alnum(const char *&ptr, const char *end) {
+			bool letter = false;
+
+#ifdef __SSE2__
+			const __m128i case_bit = _mm_set1_epi8(0x20);
+			const __m128i a_min = _mm_set1_epi8('a' - 1), a_max = _mm_set1_epi8('z' + 1);
+			const __m128i d_min = _mm_set1_epi8('0' - 1), d_max = _mm_set1_epi8('9' + 1);
+
+			while (end - ptr >= 16) {
+				__m128i v = _mm_loadu_si128((const __m128i *)ptr);
+				__m128i lower = _mm_or_si128(v, case_bit);
+
+				// signed compares are fine: bytes >= 0x80 are negative and never match
+				__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, a_min), _mm_cmplt_epi8(lower, a_max));
+				__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, d_min), _mm_cmplt_epi8(v, d_max));
+
+				unsigned int amask = _mm_movemask_epi8(alpha);
+				unsigned int mask = amask | _mm_movemask_epi8(digit);
+
+				if (mask != 0xffff) {
+					int len = __builtin_ctz(~mask);
+					letter |= (amask & ((1U << len) - 1)) != 0;
+					ptr += len;
+					return letter;
+				}
+
+				letter |= amask != 0;
+				ptr += 16;
+			}
+#endif
+			for (; ptr < end && (unsigned char)*ptr < 0x80 && isalnum((unsigned char)*ptr); ++ptr)
+				letter |= isalpha((unsigned char)*ptr) != 0;
+
+			return letter;
+		}
+
+		// skips two-byte Cyrillic letters (U+0400 - U+047F)
+		static void skip_cyrillic(const char *&ptr, const char *end) {
+#ifdef __SSE2__
+			const __m128i lead_mask = _mm_set1_epi8((char)0xfe), lead_val = _mm_set1_epi8((char)0xd0);
+			const __m128i cont_mask = _mm_set1_epi8((char)0xc0), cont_val = _mm_set1_epi8((char)0x80);
+
+			while (end - ptr >= 16) {
+				// leading bytes are 0xd0/0xd1, continuation bytes are 0x80-0xbf
+				__m128i v = _mm_loadu_si128((const __m128i *)ptr);
+				__m128i lead = _mm_cmpeq_epi8(_mm_and_si128(v, lead_mask), lead_val);
+				__m128i cont = _mm_cmpeq_epi8(_mm_and_si128(v, cont_mask), cont_val);
+
+				unsigned int lmask = _mm_movemask_epi8(lead);
+				unsigned int cmask = _mm_movemask_epi8(cont);
+
+				// every leading byte must be followed by a continuation byte and vice versa
+				unsigned int pairs = lmask & (cmask >> 1) & 0x5555;
+				if (pairs != 0x5555)
+					break;
+
+				ptr += 16;
+			}
+#endif
+			while (end - ptr >= 2 && ((unsigned char)ptr[0] == 0xd0 || (unsigned char)ptr[0] == 0xd1) &&
+					((unsigned char)ptr[1] & 0xc0) == 0x80)
+				ptr += 2;
+		}
+
+		// scans a word starting at @ptr, moves @ptr past it and returns its token class
+		static int scan_word(const char *&ptr, const char *end) {
+			bool letter = false, digit = false;
+			int prev = cc_other;
+
+			while (ptr < end) {
+				unsigned char c = *ptr;
+
+				if (c < 0x80 && (ascii_classes()[c] == cc_letter || ascii_classes()[c] == cc_digit)) {
+					bool l = skip_ascii_alnum(ptr, end);
+					letter |= l;
+					digit |= !l;
+					prev = ascii_classes()[(unsigned char)ptr[-1]];
+					continue;
+				}
+
+				if (c == 0xd0 || c == 0xd1) {
+					const char *start = ptr;
+					skip_cyrillic(ptr, end);
+					if (ptr != start) {
+						letter = true;
+						prev = cc_letter;
+						continue;
+					}
+				}
+
+				const char *next = ptr;
+				int cls = char_class(next, end);
+
+				if (cls == cc_letter || cls == cc_digit || cls == cc_extendnumlet) {
+					letter |= cls == cc_letter;
+					digit |= cls == cc_digit;
+					prev = cls;
+					ptr = next;
+					continue;
+				}
+
+				if (cls == cc_extend) {
+					ptr = next;
+					continue;
+				}
+
+				if (cls == cc_midletter || cls == cc_midnum || cls == cc_midnumlet) {
+					if (next >= end)
+						break;
+
+					const char *after = next;
+					int ncls = char_class(after, end);
+
+					bool join_letters = (cls != cc_midnum) && prev == cc_letter && ncls == cc_letter;
+					bool join_digits = (cls != cc_midletter) && prev == cc_digit && ncls == cc_digit;
+					if (join_letters || join_digits) {
+						ptr = next;
+						continue;
+					}
+				}
+
+				break;
+			}
+
+			if (letter)
+				return token_word;
+			if (digit)
+				return token_number;
+			return token_punct;
+		}
+
+		/*
+		 * Creating ICU word break iterator is expensive, so all @runs of the call are analyzed at once:
+		 * they are joined with newlines, which always break words, and the resulting tokens are merged
+		 * with the tokens pushed since @first in text order.
+		 */
+		void icu_tokenize(const char *text, const std::vector<std::pair<const char *, const char *>> &runs,
+				std::vector<token> &tokens, size_t first, int mask) const {
+			namespace lb = boost::locale::boundary;
+
+			std::string joined;
+			std::vector<size_t> offsets;
+			for (auto r = runs.begin(); r != runs.end(); ++r) {
+				offsets.push_back(joined.size());
+				joined.append(r->first, r->second);
+				joined.push_back('\n');
+			}
+
+			std::vector<token> icu;
+
+			lb::ssegment_index wmap(lb::word, joined.begin(), joined.end(), m_loc);
+			wmap.rule(lb::word_any | lb::word_none);
+
+			size_t run = 0;
+			for (auto it = wmap.begin(), e = wmap.end(); it != e; ++it) {
+				size_t offset = it->begin() - joined.begin();
+				while (run + 1 < runs.size() && offset >= offsets[run + 1])
+					++run;
+
+				// separators are skipped, segments never cross run end
+				size_t run_end = offsets[run] + (runs[run].second - runs[run].first);
+				if (offset >= run_end)
+					continue;
+				size_t size = std::min<size_t>(it->end() - it->begin(), run_end - offset);
+
+				int cls;
+				if (it->rule() & lb::word_number)
+					cls = token_number;
+				else if (it->rule() & lb::word_any)
+					cls = token_word;
+				else if (isspace((unsigned char)*it->begin()))
+					cls = token_space;
+				else
+					cls = token_punct;
+
+				const char *start = runs[run].first + (offset - offsets[run]);
+				push(icu, mask, text, start, start + size, cls);
+			}
+
+			std::vector<token> native(tokens.begin() + first, tokens.end());
+			tokens.resize(first);
+			std::merge(native.begin(), native.end(), icu.begin(), icu.end(), std::back_inserter(tokens),
+					[] (const token &a, const token &b) {
+						return a.offset < b.offset;
+					});
+		}
+};
+
+}} // namespace ioremap::warp
+
+#endif /* __WARP_TOKENIZER_HPP */
@@ -0,0 +1,97 @@
+#include "warp/block.hpp"
+#include "warp/column.hpp"
+#include "warp/decode.hpp"
+#include "warp/mmap.hpp"
+#include "warp/timer.hpp"
+
+#include <boost/program_options.hpp>
+
+#include <iostream>
+
+using namespace ioremap;
+
+int main(int argc, char *argv[])
+{
+	namespace bpo = boost::program_options;
+
+	bpo::options_description generic("Record decoder benchmark options");
+
+	int iterations;
+
+	generic.add_options()
+		("help", "This help message")
+		("iterations", bpo::value<int>(&iterations)->default_value(3), "Number of passes over every file")
+		;
+
+	bpo::positional_options_description p;
+	p.add("files", -1);
+
+	std::vector<std::string> files;
+
+	bpo::options_description hidden("Positional options");
+	hidden.add_options()
+		("files", bpo::value<std::vector<std::string>>(&files), "uncompressed msgpack dictionary files")
+	;
+
+	bpo::variables_map vm;
+
+	try {
+		bpo::options_description cmdline_options;
+		cmdline_options.add(generic).add(hidden);
+
+		bpo::store(bpo::command_line_parser(argc, argv).options(cmdline_options).positional(p).run(), vm);
+		bpo::notify(vm);
+	} catch (const std::exception &e) {
+		std::cerr << "Invalid options: " << e.what() << "\n" << generic << std::endl;
+		return -1;
+	}
+
+	if (vm.count("help") || !files.size()) {
+		std::cerr << "There are no input files\n" << generic << "\n" << hidden << std::endl;
+		return -1;
+	}
+
+	for (auto file = files.begin(); file != files.end(); ++file) {
+		if (warp::block::is_block_file(*file) || warp::column::is_columnar_file(*file)) {
+			std::cerr << "decode: '" << *file << "' is not a plain msgpack file, skipping" << std::endl;
+			continue;
+		}
+
+		try {
+			warp::mapped_file in(*file);
+			warp::parsed_word_view rec;
+
+			auto run = [&] (void (*decode)(warp::msgpack_reader &, warp::parsed_word_view &), long &records) -> long {
+				warp::timer tm;
+
+				for (int i = 0; i < iterations; ++i) {
+					warp::msgpack_reader reader(in.data(), in.size());
+
+					records = 0;
+					while (!reader.empty()) {
+						decode(reader, rec);
+						++records;
+					}
+				}
+
+				return tm.elapsed();
+			};
+
+			long records = 0;
+			long generic_time = run(warp::decode_record_generic, records);
+			long fast_time = run(warp::decode_record, records);
+
+			auto rate = [&] (long ms) {
+				return ms ? records * iterations * 1000 / ms : 0;
+			};
+
+			std::cout << *file << ": size: " << in.size() << ", records: " << records <<
+				", generic: " << generic_time << " ms, " << rate(generic_time) << " records/sec" <<
+				", fast path: " << fast_time << " ms, " << rate(fast_time) << " records/sec" << std::endl;
+		} catch (const std::exception &e) {
+			std::cerr << "decode: '" << *file << "': " << e.what() << std::endl;
+		}
+	}
+
+	return 0;
+}
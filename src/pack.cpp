@@ -14,23 +14,37 @@
  * limitations under the License.
  */
 
+#include "warp/delta.hpp"
 #include "warp/pack.hpp"
 
 #include <boost/program_options.hpp>
 
+#include <string.h>
+
 int main(int argc, char *argv[])
 {
 	namespace bpo = boost::program_options;
 
 	bpo::options_description generic("Parser options");
 
-	int output_num;
-	std::string input, output, msgin, gram;
+	int output_num, thread_num;
+	size_t memory_limit;
+	std::string input, output, msgin, gram, format, remove;
 	generic.add_options()
 		("help", "This help message")
 		("input", bpo::value<std::string>(&input)->required(), "Input Zaliznyak dictionary file")
-		("output", bpo::value<std::string>(&output)->required(), "Output msgpack file")
-		("output-num", bpo::value<int>(&output_num)->default_value(1), "Number of output msgpack files")
+		("output", bpo::value<std::string>(&output)->required(), "Output dictionary file")
+		("output-num", bpo::value<int>(&output_num)->default_value(1), "Number of output dictionary files")
+		("format", bpo::value<std::string>(&format)->default_value("columnar"),
+			"Output file format: columnar or msgpack")
+		("compress", "Write output files into block-compressed containers")
+		("threads", bpo::value<int>(&thread_num)->default_value(0), "Number of parser threads, 0 means number of cores")
+		("memory-limit", bpo::value<size_t>(&memory_limit)->default_value(256),
+			"Records are sorted in temporary files when they take more than this many megabytes")
+		("validate", "Parse every dictionary line with ICU word boundary analysis too and report differences")
+		("delta", "Write a single delta file which adds records of the input dictionary instead of packing it")
+		("remove", bpo::value<std::string>(&remove),
+			"Zaliznyak dictionary file whose records are removed by the delta file, used with --delta")
 		;
 
 	bpo::positional_options_description p;
@@ -63,10 +77,57 @@ int main(int argc, char *argv[])
 
 	namespace iw = ioremap::warp;
 
-	iw::packer pack(output, output_num);
+	if (vm.count("delta")) {
+		iw::delta_writer delta;
+		int err = delta.open(output);
+
+		auto parse = [&] (const std::string &path, int op) {
+			if (err || path.empty())
+				return;
+
+			iw::zparser records;
+			records.set_process([&] (const iw::parsed_word &rec) {
+					err = delta.add(op, rec);
+					return err == 0;
+				});
+			records.parse_file(path, thread_num);
+		};
+
+		parse(remove, iw::delta_record::remove);
+		parse(input, iw::delta_record::add);
+
+		if (!err)
+			err = delta.close();
+		if (err) {
+			std::cerr << "Could not write delta file '" << output << "': " << strerror(-err) << std::endl;
+			return err;
+		}
+
+		return 0;
+	}
+
+	iw::packer::output_format fmt;
+	if (format == "columnar") {
+		fmt = iw::packer::format_columnar;
+	} else if (format == "msgpack") {
+		fmt = iw::packer::format_msgpack;
+	} else {
+		std::cerr << "Invalid output format '" << format << "'\n" << generic << std::endl;
+		return -1;
+	}
+
+	iw::packer pack(output, output_num, memory_limit * 1024 * 1024, fmt, vm.count("compress") != 0);
 	iw::zparser records;
 	records.set_process(std::bind(&iw::packer::zprocess, &pack, std::placeholders::_1));
-	records.parse_file(input);
+	records.set_validate(vm.count("validate") != 0);
+	records.parse_file(input, thread_num);
+
+	int err = pack.finish();
+	if (err)
+		return err;
+
+	if (records.mismatches())
+		return -1;
 
 	return 0;
 }
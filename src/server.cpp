@@ -25,8 +25,24 @@
 #include <thevoid/rapidjson/stringbuffer.h>
 #include <thevoid/rapidjson/prettywriter.h>
 
+#include <stdlib.h>
+
 using namespace ioremap;
 
+// canonical path of the file or empty string if it does not exist
+static std::string real_path(const std::string &path)
+{
+	std::string ret;
+
+	char *real = realpath(path.c_str(), NULL);
+	if (real) {
+		ret.assign(real);
+		free(real);
+	}
+
+	return ret;
+}
+
 template <typename T>
 struct on_grammar : public thevoid::simple_request_stream<T>, public std::enable_shared_from_this<on_grammar<T>>
 {
@@ -118,58 +134,85 @@ struct on_grammar : public thevoid::simple_request_stream<T>, public std::enable
 		this->logger().log(swarm::SWARM_LOG_NOTICE, "grammar::parse_single_element: length: %zd, data: '%s', normalize: %d",
 				data.size(), data.c_str(), normalize);
 
+		warp::analyze_options opt;
+		opt.lookup = !normalize;
+		opt.normalize = normalize;
+		if (!normalize && val.HasMember("grammar"))
+			opt.gram = this->server()->lex().compile(val["grammar"].GetString());
+
+		warp::analysis an = this->server()->lex().analyze(data, opt);
+
 		if (normalize) {
-			std::vector<std::string> roots = this->server()->lex().normalize_sentence(data);
-			std::ostringstream ss;
+			std::string text;
+			text.reserve(an.arena.size() + an.tokens.size());
+
+			// words whose roots are the best candidates found before search budget has been exhausted
+			rapidjson::Value partial(rapidjson::kArrayType);
 
-			for (auto it = roots.begin(); it != roots.end(); ++it)
-				ss << *it << " ";
+			for (size_t i = 0; i < an.tokens.size(); ++i) {
+				auto root = an.root(i);
+				text.append(root.data(), root.size());
+				text.append(" ");
+
+				if (an.tokens[i].partial) {
+					auto word = an.word(i);
+					rapidjson::Value w(word.data(), word.size(), allocator);
+					partial.PushBack(w, allocator);
+				}
+			}
 
-			std::string text = ss.str();
 			rapidjson::Value norm(text.c_str(), text.size(), allocator);
 			reply.AddMember("normalize", norm, allocator);
+			reply.AddMember("partial", !partial.Empty(), allocator);
+			reply.AddMember("partial-words", partial, allocator);
 		} else {
 			rapidjson::Value data_obj(rapidjson::kObjectType);
 
-			std::vector<warp::word_features> ewords = this->server()->lex().lookup_sentence(data);
-			for (auto it = ewords.begin(); it != ewords.end(); ++it) {
+			for (size_t i = 0; i < an.tokens.size(); ++i) {
 				rapidjson::Value features(rapidjson::kArrayType);
 
-				for (auto ef = it->fvec.begin(); ef != it->fvec.end(); ++ef) {
+				const auto &r = an.tokens[i].features;
+				for (auto ef = r.first; ef != r.second; ++ef) {
 					rapidjson::Value obj(rapidjson::kObjectType);
 
-					obj.AddMember("features", ef->features, allocator);
+					// tags below 64 are kept in a single number as before, all mask words are in the array
+					rapidjson::Value words(rapidjson::kArrayType);
+					for (size_t w = 0; w < warp::parsed_word::feature_mask::words; ++w)
+						words.PushBack((uint64_t)ef->features.w[w], allocator);
+
+					obj.AddMember("features", (uint64_t)ef->features.w[0], allocator);
+					obj.AddMember("feature-words", words, allocator);
 					obj.AddMember("ending-length", ef->ending_len, allocator);
 
 					features.PushBack(obj, allocator);
 				}
 
-				data_obj.AddMember(it->word.c_str(), allocator, features, allocator);
+				auto word = an.word(i);
+				rapidjson::Value name(word.data(), word.size(), allocator);
+				data_obj.AddMember(name, features, allocator);
 			}
 			reply.AddMember("lemmas", data_obj, allocator);
 
-			if (val.HasMember("grammar")) {
+			if (opt.gram) {
 				rapidjson::Value grammar_obj(rapidjson::kObjectType);
-				std::string grammar = val["grammar"].GetString();
-
-				std::vector<warp::grammar> grams = this->server()->lex().generate(grammar);
-				std::vector<int> starts = this->server()->lex().grammar_deduction_sentence(grams, data);
+				const std::vector<warp::grammar> &grams = opt.gram->grams;
 
 				rapidjson::Value jstarts(rapidjson::kArrayType);
 				rapidjson::Value jstrings(rapidjson::kArrayType);
 
-				for (auto s = starts.begin(); s != starts.end(); ++s) {
+				for (auto s = an.grammar_starts.begin(); s != an.grammar_starts.end(); ++s) {
 					jstarts.PushBack(*s, allocator);
 
-					std::ostringstream out;
+					std::string out;
 					for (size_t i = 0; i < grams.size(); ++i) {
-						out << ewords[i + *s].word;
+						auto word = an.word(i + *s);
+						out.append(word.data(), word.size());
 						if (i != grams.size() - 1)
-							out << " ";
+							out.append(" ");
 					}
 
 					rapidjson::Value tmp;
-					tmp.SetString(out.str().c_str(), allocator);
+					tmp.SetString(out.c_str(), out.size(), allocator);
 
 					jstrings.PushBack(tmp, allocator);
 				}
@@ -185,6 +228,101 @@ struct on_grammar : public thevoid::simple_request_stream<T>, public std::enable
 	}
 };
 
+// applies delta files to the loaded dictionary: {"delta": "name"} or {"delta": ["name", ...]},
+// names are relative to the "delta-dir" directory of the config, files outside of it are rejected
+template <typename T>
+struct on_update : public thevoid::simple_request_stream<T>, public std::enable_shared_from_this<on_update<T>>
+{
+	virtual void on_request(const swarm::http_request &http_req, const boost::asio::const_buffer &buffer) {
+		(void) http_req;
+
+		rapidjson::Document doc;
+		const char *ptr = boost::asio::buffer_cast<const char*>(buffer);
+		if (!ptr) {
+			this->logger().log(swarm::SWARM_LOG_ERROR, "update::request: empty request\n");
+			this->send_reply(swarm::http_response::bad_request);
+			return;
+		}
+
+		std::string buf;
+		buf.assign(ptr, boost::asio::buffer_size(buffer));
+
+		doc.Parse<0>(buf.c_str());
+		if (doc.HasParseError() || !doc.IsObject() || !doc.HasMember("delta")) {
+			this->logger().log(swarm::SWARM_LOG_ERROR, "update::request: no 'delta' field in the document");
+			this->send_reply(swarm::http_response::bad_request);
+			return;
+		}
+
+		std::vector<std::string> path;
+
+		const rapidjson::Value &delta = doc["delta"];
+		if (delta.IsArray()) {
+			for (rapidjson::Value::ConstValueIterator it = delta.Begin(); it != delta.End(); ++it) {
+				if (!it->IsString()) {
+					this->logger().log(swarm::SWARM_LOG_ERROR, "update::request: 'delta' array must contain strings");
+					this->send_reply(swarm::http_response::bad_request);
+					return;
+				}
+
+				path.push_back(it->GetString());
+			}
+		} else if (delta.IsString()) {
+			path.push_back(delta.GetString());
+		} else {
+			this->logger().log(swarm::SWARM_LOG_ERROR, "update::request: 'delta' must be a string or an array of strings");
+			this->send_reply(swarm::http_response::bad_request);
+			return;
+		}
+
+		std::string dir = this->server()->delta_dir();
+		if (dir[dir.size() - 1] != '/')
+			dir += "/";
+
+		// symlinks and '..' are resolved before the check
+		for (auto p = path.begin(); p != path.end(); ++p) {
+			std::string real = real_path(dir + *p);
+			if (real.size() <= dir.size() || real.compare(0, dir.size(), dir)) {
+				this->logger().log(swarm::SWARM_LOG_ERROR, "update::request: delta '%s' is not a file in %s",
+						p->c_str(), dir.c_str());
+				this->send_reply(swarm::http_response::bad_request);
+				return;
+			}
+
+			*p = real;
+		}
+
+		try {
+			size_t records = this->server()->lex().apply_delta(path);
+
+			rapidjson::Document reply;
+			reply.SetObject();
+			reply.AddMember("records", (uint64_t)records, reply.GetAllocator());
+
+			rapidjson::StringBuffer sbuf;
+			rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(sbuf);
+
+			reply.Accept(writer);
+			sbuf.Put('\n');
+
+			swarm::url_fetcher::response http_reply;
+			http_reply.set_code(swarm::url_fetcher::response::ok);
+			http_reply.headers().set_content_length(sbuf.Size());
+			http_reply.headers().set_content_type("text/json");
+
+			this->logger().log(swarm::SWARM_LOG_INFO, "update::request: files: %zd, records: %zd",
+					path.size(), records);
+
+			this->send_reply(std::move(http_reply), std::string(sbuf.GetString()));
+		} catch (const std::exception &e) {
+			this->logger().log(swarm::SWARM_LOG_ERROR, "update::request: caught exception during processing: %s",
+					e.what());
+			this->send_reply(swarm::http_response::bad_request);
+			return;
+		}
+	}
+};
+
 class http_server : public thevoid::server<http_server>
 {
 public:
@@ -205,10 +343,69 @@ public:
 			path.push_back(input.GetString());
 		}
 
-		m_lex.load(3, path);
+		long max_candidates = 0, max_time = 0;
+		if (config.HasMember("search-max-candidates"))
+			max_candidates = config["search-max-candidates"].GetInt64();
+		if (config.HasMember("search-max-time"))
+			max_time = config["search-max-time"].GetInt64();
+
+		m_lex.set_search_budget(max_candidates, max_time);
+
+		// morph index is built once and then read from this file until dictionaries change
+		std::string index;
+		if (config.HasMember("morph-index"))
+			index = config["morph-index"].GetString();
+
+		try {
+			bool loaded = m_lex.load(3, path, index);
+			if (!index.empty()) {
+				this->logger().log(swarm::SWARM_LOG_INFO, "initialize: morph index %s has been %s",
+						index.c_str(), loaded ? "loaded" : "built and saved");
+			}
+		} catch (const std::exception &e) {
+			this->logger().log(swarm::SWARM_LOG_ERROR, "initialize: %s", e.what());
+			return false;
+		}
 
 		this->logger().log(swarm::SWARM_LOG_INFO, "grammar::request: data from %s (and other files) has been loaded", path[0].c_str());
 
+		if (config.HasMember("delta-input")) {
+			std::vector<std::string> delta;
+
+			const auto &dinput = config["delta-input"];
+			if (dinput.IsArray()) {
+				for (rapidjson::Value::ConstValueIterator it = dinput.Begin(); it != dinput.End(); ++it)
+					delta.push_back(it->GetString());
+			} else {
+				delta.push_back(dinput.GetString());
+			}
+
+			try {
+				for (auto d = delta.begin(); d != delta.end(); ++d) {
+					size_t records = m_lex.apply_delta(*d);
+					this->logger().log(swarm::SWARM_LOG_INFO, "initialize: delta %s: %zd records have been applied",
+							d->c_str(), records);
+				}
+			} catch (const std::exception &e) {
+				this->logger().log(swarm::SWARM_LOG_ERROR, "initialize: could not apply delta: %s", e.what());
+				return false;
+			}
+		}
+
+		if (config.HasMember("delta-dir")) {
+			m_delta_dir = real_path(config["delta-dir"].GetString());
+			if (m_delta_dir.empty()) {
+				this->logger().log(swarm::SWARM_LOG_ERROR, "initialize: delta-dir %s does not exist",
+						config["delta-dir"].GetString());
+				return false;
+			}
+
+			on<on_update<http_server>>(
+				options::exact_match("/update"),
+				options::methods("POST")
+			);
+		}
+
 		on<on_grammar<http_server>>(
 			options::exact_match("/grammar"),
 			options::methods("POST")
@@ -221,8 +418,14 @@ public:
 		return m_lex;
 	}
 
+	// canonical path, /update only accepts files inside of it
+	const std::string &delta_dir(void) const {
+		return m_delta_dir;
+	}
+
 private:
 	warp::lex m_lex;
+	std::string m_delta_dir;
 };
 
 int main(int argc, char *argv[])
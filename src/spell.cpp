@@ -1,5 +1,6 @@
 #include "warp/lstring.hpp"
 #include "warp/spell.hpp"
+#include "warp/tokenizer.hpp"
 
 #include <boost/program_options.hpp>
 
@@ -16,7 +17,7 @@ int main(int argc, char *argv[])
 	generic.add_options()
 		("help", "This help message")
 		("ngram", bpo::value<int>(&num)->default_value(3), "Number of symbols in each ngram")
-		("msgpack", "Whether files are msgpack packed Zaliznyak dictionary files")
+		("msgpack", "Whether files are Zaliznyak dictionary files packed by warp_zpack (columnar or msgpack)")
 		;
 
 	bpo::positional_options_description p;
@@ -60,6 +61,8 @@ int main(int argc, char *argv[])
 		if (vm.count("msgpack")) {
 			sp.feed_dict(files);
 		} else {
+			warp::tokenizer tok;
+
 			for (auto file = files.begin(); file != files.end(); ++file) {
 				std::ifstream in(file->c_str());
 				if (in.bad()) {
@@ -73,17 +76,18 @@ int main(int argc, char *argv[])
 
 				std::string text = ss.str();
 
-				namespace lb = boost::locale::boundary;
-
-				lb::ssegment_index wmap(lb::word, text.begin(), text.end(), warp::__fuzzy_locale);
-				wmap.rule(lb::word_any);
+				std::vector<warp::token> tokens;
+				tok.tokenize(text.data(), text.size(), tokens);
 
-				for (auto it = wmap.begin(), e = wmap.end(); it != e; ++it) {
-					std::string word = boost::locale::to_lower(it->str(), warp::__fuzzy_locale);
+				for (auto it = tokens.begin(); it != tokens.end(); ++it) {
+					const char *ptr = text.data() + it->offset;
+					std::string word = boost::locale::to_lower(ptr, ptr + it->size, warp::__fuzzy_locale);
 
 					sp.feed_word(word);
 				}
 			}
+
+			sp.freeze();
 		}
 
 		sp.search(text);
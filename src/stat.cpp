@@ -1,5 +1,6 @@
 #include "warp/lstring.hpp"
 #include "warp/spell.hpp"
+#include "warp/tokenizer.hpp"
 
 #include <boost/program_options.hpp>
 
@@ -7,8 +8,6 @@
 
 using namespace ioremap;
 
-namespace lb = boost::locale::boundary;
-
 int main(int argc, char *argv[])
 {
 	namespace bpo = boost::program_options;
@@ -119,6 +118,7 @@ int main(int argc, char *argv[])
 		counts = out;
 	} else {
 		size_t words = 0;
+		warp::tokenizer tok;
 
 		for (auto file = files.begin(); file != files.end(); ++file) {
 			std::ifstream in(file->c_str());
@@ -132,11 +132,12 @@ int main(int argc, char *argv[])
 
 			std::string text = ss.str();
 
-			lb::ssegment_index wmap(lb::word, text.begin(), text.end(), warp::__fuzzy_locale);
-			wmap.rule(lb::word_any);
+			std::vector<warp::token> tokens;
+			tok.tokenize(text.data(), text.size(), tokens);
 
-			for (auto it = wmap.begin(), e = wmap.end(); it != e; ++it) {
-				std::string word = boost::locale::to_lower(it->str(), warp::__fuzzy_locale);
+			for (auto it = tokens.begin(); it != tokens.end(); ++it) {
+				const char *ptr = text.data() + it->offset;
+				std::string word = boost::locale::to_lower(ptr, ptr + it->size, warp::__fuzzy_locale);
 
 				auto wc = counts.find(word);
 				if (wc != counts.end()) {
@@ -0,0 +1,124 @@
+#include "warp/lstring.hpp"
+#include "warp/timer.hpp"
+#include "warp/tokenizer.hpp"
+
+#include <boost/program_options.hpp>
+
+using namespace ioremap;
+
+int main(int argc, char *argv[])
+{
+	namespace bpo = boost::program_options;
+	namespace lb = boost::locale::boundary;
+
+	bpo::options_description generic("Tokenizer benchmark options");
+
+	int iterations;
+
+	generic.add_options()
+		("help", "This help message")
+		("iterations", bpo::value<int>(&iterations)->default_value(3), "Number of passes over every file")
+		("diff", "Print tokens which differ between native tokenizer and boost::locale (ICU) boundary analysis")
+		;
+
+	bpo::positional_options_description p;
+	p.add("files", -1);
+
+	std::vector<std::string> files;
+
+	bpo::options_description hidden("Positional options");
+	hidden.add_options()
+		("files", bpo::value<std::vector<std::string>>(&files), "files to tokenize")
+	;
+
+	bpo::variables_map vm;
+
+	try {
+		bpo::options_description cmdline_options;
+		cmdline_options.add(generic).add(hidden);
+
+		bpo::store(bpo::command_line_parser(argc, argv).options(cmdline_options).positional(p).run(), vm);
+		bpo::notify(vm);
+	} catch (const std::exception &e) {
+		std::cerr << "Invalid options: " << e.what() << "\n" << generic << std::endl;
+		return -1;
+	}
+
+	if (vm.count("help") || !files.size()) {
+		std::cerr << "There are no input files\n" << generic << "\n" << hidden << std::endl;
+		return -1;
+	}
+
+	warp::tokenizer tok;
+
+	for (auto file = files.begin(); file != files.end(); ++file) {
+		std::ifstream in(file->c_str());
+		if (!in.good()) {
+			std::cerr << "tokenize: could not open file '" << *file << "': " << in.rdstate() << std::endl;
+			continue;
+		}
+
+		std::ostringstream ss;
+		ss << in.rdbuf();
+		std::string text = ss.str();
+
+		std::vector<warp::token> native;
+		std::vector<std::pair<size_t, size_t>> icu;
+
+		warp::timer tm;
+		for (int i = 0; i < iterations; ++i) {
+			native.clear();
+			tok.tokenize(text.data(), text.size(), native);
+		}
+		long native_time = tm.restart();
+
+		for (int i = 0; i < iterations; ++i) {
+			icu.clear();
+
+			lb::ssegment_index wmap(lb::word, text.begin(), text.end(), warp::__fuzzy_locale);
+			wmap.rule(lb::word_any);
+
+			for (auto it = wmap.begin(), e = wmap.end(); it != e; ++it)
+				icu.emplace_back(it->begin() - text.begin(), it->end() - it->begin());
+		}
+		long icu_time = tm.restart();
+
+		size_t mismatches = 0;
+		auto n = native.begin();
+		auto c = icu.begin();
+		while (n != native.end() || c != icu.end()) {
+			if (n != native.end() && c != icu.end() && n->offset == c->first && n->size == c->second) {
+				++n;
+				++c;
+				continue;
+			}
+
+			++mismatches;
+
+			// advance the side which is behind in the text
+			bool native_behind = c == icu.end() || (n != native.end() && n->offset + n->size <= c->first + c->second);
+			if (native_behind) {
+				if (vm.count("diff"))
+					std::cout << "native: '" << text.substr(n->offset, n->size) << "'" << std::endl;
+				++n;
+			} else {
+				if (vm.count("diff"))
+					std::cout << "icu: '" << text.substr(c->first, c->second) << "'" << std::endl;
+				++c;
+			}
+		}
+
+		auto rate = [&] (size_t tokens, long ms) {
+			return ms ? tokens * iterations * 1000 / ms : 0;
+		};
+
+		std::cout << *file << ": size: " << text.size() <<
+			", native: tokens: " << native.size() << ", time: " << native_time << " ms, " <<
+				rate(native.size(), native_time) << " tokens/sec" <<
+			", icu: tokens: " << icu.size() << ", time: " << icu_time << " ms, " <<
+				rate(icu.size(), icu_time) << " tokens/sec" <<
+			", mismatches: " << mismatches << std::endl;
+	}
+
+	return 0;
+}
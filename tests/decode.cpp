@@ -0,0 +1,158 @@
+#include "warp/decode.hpp"
+#include "warp/pack.hpp"
+
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace ioremap;
+
+/*
+ * decode_record_fast() must agree with decode_record_generic() on every input it accepts:
+ * the same record and the same number of consumed bytes. Records written by the packer
+ * are decoded by both decoders and then compared on randomly corrupted copies of the stream.
+ */
+
+static bool same(const warp::parsed_word_view &a, const warp::parsed_word_view &b)
+{
+	return a.lemma == b.lemma && a.word == b.word && a.features == b.features && a.ending_len == b.ending_len;
+}
+
+static std::string random_string(std::mt19937 &rng)
+{
+	// mostly short strings, some of them do not fit fixstr
+	size_t size = (rng() % 16 == 0) ? 32 + rng() % 300 : rng() % 20;
+
+	std::string ret;
+	for (size_t i = 0; i < size; ++i)
+		ret.push_back('a' + rng() % 26);
+	return ret;
+}
+
+// returns packed records, @starts gets offset of every record
+static std::string pack_records(std::mt19937 &rng, size_t num, std::vector<size_t> &starts)
+{
+	warp::shard_writer::buffer buf;
+	msgpack::packer<warp::shard_writer::buffer> pk(buf);
+
+	for (size_t i = 0; i < num; ++i) {
+		starts.push_back(buf.data.size());
+
+		warp::parsed_word rec;
+		rec.lemma = random_string(rng);
+		rec.word = random_string(rng);
+
+		for (size_t w = 0; w < warp::parsed_word::feature_mask::words; ++w) {
+			// every integer width
+			rec.features.w[w] = ((uint64_t)rng() << 32 | rng()) >> (rng() % 64);
+		}
+
+		// endings which do not fit fixint go to the generic decoder
+		rec.ending_len = (rng() % 32 == 0) ? 128 + rng() % 1000 : rng() % 10;
+
+		if (rng() % 16 == 0) {
+			// version 1 record with a single feature word
+			pk.pack_array(5);
+			pk.pack((int)1);
+			pk.pack(rec.lemma);
+			pk.pack(rec.word);
+			pk.pack((uint64_t)rec.features.w[0]);
+			pk.pack(rec.ending_len);
+		} else {
+			pk << rec;
+		}
+	}
+
+	return buf.data;
+}
+
+static int check_stream(const std::string &data, size_t num)
+{
+	warp::msgpack_reader fast(data.data(), data.size());
+	warp::msgpack_reader generic(data.data(), data.size());
+	warp::parsed_word_view fv, gv;
+
+	size_t records = 0;
+	for (; !generic.empty(); ++records) {
+		warp::decode_record(fast, fv);
+		warp::decode_record_generic(generic, gv);
+
+		if (!same(fv, gv) || fast.offset() != generic.offset()) {
+			std::cerr << "record " << records << ": decoders disagree at offset " << generic.offset() << std::endl;
+			return -1;
+		}
+	}
+
+	if (records != num || !fast.empty()) {
+		std::cerr << "records: " << records << ", must be: " << num << std::endl;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int check_corrupted(std::mt19937 &rng, const std::string &data, const std::vector<size_t> &starts, int iterations)
+{
+	int accepted = 0;
+
+	for (int i = 0; i < iterations; ++i) {
+		// a record and the beginning of the next one with a couple of random bytes
+		size_t offset = starts[rng() % starts.size()];
+		std::string tmp(data, offset, 512);
+		for (int k = 1 + rng() % 2; k > 0; --k)
+			tmp[rng() % std::min<size_t>(tmp.size(), 64)] = rng();
+
+		// truncated records
+		if (rng() % 8 == 0)
+			tmp.resize(rng() % tmp.size());
+
+		warp::msgpack_reader fast(tmp.data(), tmp.size());
+		warp::msgpack_reader generic(tmp.data(), tmp.size());
+		warp::parsed_word_view fv, gv;
+
+		if (!warp::decode_record_fast(fast, fv)) {
+			if (fast.offset() != 0) {
+				std::cerr << "rejected input has been consumed" << std::endl;
+				return -1;
+			}
+			continue;
+		}
+
+		try {
+			warp::decode_record_generic(generic, gv);
+		} catch (const std::exception &e) {
+			std::cerr << "generic decoder rejects record accepted by the fast one: " << e.what() << std::endl;
+			return -1;
+		}
+
+		if (!same(fv, gv) || fast.offset() != generic.offset()) {
+			std::cerr << "decoders disagree on corrupted record" << std::endl;
+			return -1;
+		}
+
+		++accepted;
+	}
+
+	// most corrupted records must still reach the comparison, otherwise the check proves nothing
+	if (accepted < iterations / 4) {
+		std::cerr << "corrupted inputs: " << iterations << ", accepted by the fast decoder: " << accepted << std::endl;
+		return -1;
+	}
+
+	return 0;
+}
+
+int main()
+{
+	std::mt19937 rng(1);
+	size_t num = 100000;
+
+	std::vector<size_t> starts;
+	std::string data = pack_records(rng, num, starts);
+
+	if (check_stream(data, num) || check_corrupted(rng, data, starts, 200000))
+		return -1;
+
+	return 0;
+}
@@ -0,0 +1,166 @@
+#include "warp/frozen.hpp"
+#include "warp/morph.hpp"
+
+#include <iostream>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace ioremap;
+
+/*
+ * Saved frozen_hash and morph_index must be loaded back into the same tables: every key is found
+ * with the same id, misses stay misses and every morph record is in place. Truncated or corrupted
+ * data must be rejected and leave an empty table behind.
+ */
+
+static std::string random_key(std::mt19937 &rng)
+{
+	std::string ret;
+	for (int i = 1 + rng() % 20; i > 0; --i)
+		ret.push_back('a' + rng() % 26);
+	return ret;
+}
+
+static int check_frozen(std::mt19937 &rng)
+{
+	std::vector<std::string> keys;
+	for (int i = 0; i < 20000; ++i)
+		keys.push_back(random_key(rng) + std::to_string(i));
+
+	warp::frozen_hash fh;
+	fh.build(keys);
+
+	std::stringstream ss;
+	if (!fh.save(ss)) {
+		std::cerr << "frozen_hash: could not save" << std::endl;
+		return -1;
+	}
+	std::string data = ss.str();
+
+	warp::frozen_hash loaded;
+	std::istringstream in(data);
+	if (!loaded.load(in) || loaded.size() != keys.size()) {
+		std::cerr << "frozen_hash: could not load saved table" << std::endl;
+		return -1;
+	}
+
+	for (size_t i = 0; i < keys.size(); ++i) {
+		if (loaded.find(keys[i]) != i) {
+			std::cerr << "frozen_hash: key " << keys[i] << ": id: " << loaded.find(keys[i]) << ", must be " << i << std::endl;
+			return -1;
+		}
+
+		// digits never end the random part of the key, so this is never a key
+		std::string miss = keys[i] + "x0";
+		if (loaded.find(miss) != warp::frozen_hash::npos) {
+			std::cerr << "frozen_hash: missing key " << miss << " has been found" << std::endl;
+			return -1;
+		}
+	}
+
+	// every truncation point within the header and a few within the arrays
+	for (size_t size = 0; size < data.size(); size += (size < 64) ? 1 : 1 + rng() % 4096) {
+		std::istringstream tin(data.substr(0, size));
+		if (loaded.load(tin) || loaded.size() || loaded.find(keys[0]) != warp::frozen_hash::npos) {
+			std::cerr << "frozen_hash: data truncated to " << size << " bytes has been loaded" << std::endl;
+			return -1;
+		}
+	}
+
+	std::string bad = data;
+	bad[0] = 'X';
+	std::istringstream bin(bad);
+	if (loaded.load(bin)) {
+		std::cerr << "frozen_hash: data with invalid magic has been loaded" << std::endl;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int check_morph(std::mt19937 &rng)
+{
+	warp::morph_index morph;
+	morph.prepare(2);
+
+	std::set<std::string> lemmas;
+	for (int i = 0; i < 5000; ++i) {
+		warp::parsed_word rec;
+		rec.lemma = "lemma" + std::to_string(rng() % 300);
+		rec.word = random_key(rng);
+		rec.features.set(rng() % warp::parsed_word::feature_mask::bits);
+		rec.ending_len = rng() % 5;
+
+		lemmas.insert(rec.lemma);
+		morph.add(i % 2, rec);
+	}
+	morph.freeze();
+
+	std::stringstream ss;
+	if (!morph.save(ss)) {
+		std::cerr << "morph_index: could not save" << std::endl;
+		return -1;
+	}
+	std::string data = ss.str();
+
+	warp::morph_index loaded;
+	std::istringstream in(data);
+	if (!loaded.load(in) || loaded.forms_num() != morph.forms_num() || loaded.entries_num() != morph.entries_num()) {
+		std::cerr << "morph_index: could not load saved index" << std::endl;
+		return -1;
+	}
+
+	int err = 0;
+	morph.for_each([&] (const warp::parsed_word &rec) {
+			if (err)
+				return;
+
+			warp::morph_index::range r = loaded.lookup(rec.word);
+			for (auto e = r.first; e != r.second; ++e) {
+				if (e->features == rec.features && e->ending_len == rec.ending_len && loaded.lemma(e->lemma_id) == rec.lemma)
+					return;
+			}
+
+			std::cerr << "morph_index: word " << rec.word << ", lemma " << rec.lemma << ": record has been lost" << std::endl;
+			err = -1;
+		});
+	if (err)
+		return err;
+
+	for (size_t size = 0; size < data.size(); size += 1 + rng() % 1024) {
+		std::istringstream tin(data.substr(0, size));
+		if (loaded.load(tin) || loaded.forms_num() || loaded.entries_num()) {
+			std::cerr << "morph_index: data truncated to " << size << " bytes has been loaded" << std::endl;
+			return -1;
+		}
+	}
+
+	// lemma pool is at the end of the data, make the last lemma offset point past it
+	size_t pool_size = 0;
+	for (auto l = lemmas.begin(); l != lemmas.end(); ++l)
+		pool_size += l->size();
+
+	std::string bad = data;
+	bad[data.size() - pool_size - sizeof(uint32_t)] ^= 0x40;
+	std::istringstream bin(bad);
+	if (loaded.load(bin)) {
+		std::cerr << "morph_index: inconsistent data has been loaded" << std::endl;
+		return -1;
+	}
+
+	return 0;
+}
+
+int main()
+{
+	std::mt19937 rng(1);
+
+	int err = check_frozen(rng);
+	if (!err)
+		err = check_morph(rng);
+
+	return err;
+}
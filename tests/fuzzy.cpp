@@ -0,0 +1,101 @@
+#include "warp/distance.hpp"
+#include "warp/fuzzy.hpp"
+
+#include <iostream>
+#include <random>
+#include <set>
+#include <vector>
+
+using namespace ioremap;
+
+/*
+ * Prefix filtering in fuzzy::search() must not lose matches: every dictionary word within
+ * max_distance edits of the query which the unfiltered search (any shared n-gram) returns
+ * has to be returned by the filtered search too. Distances are checked by brute force
+ * over the whole dictionary. Small alphabet makes n-grams frequent and posting lists long.
+ */
+
+static warp::lstring random_word(std::mt19937 &rng)
+{
+	warp::lstring ret;
+	for (int i = 3 + rng() % 12; i > 0; --i)
+		ret.push_back(warp::letter<unsigned>('a' + rng() % 6));
+	return ret;
+}
+
+static warp::lstring random_edits(std::mt19937 &rng, warp::lstring word, int edits)
+{
+	for (int i = 0; i < edits && word.size(); ++i) {
+		size_t pos = rng() % word.size();
+		warp::letter<unsigned> l('a' + rng() % 6);
+
+		switch (rng() % 3) {
+		case 0:
+			word[pos] = l;
+			break;
+		case 1:
+			word.insert(word.begin() + pos, l);
+			break;
+		case 2:
+			word.erase(word.begin() + pos);
+			break;
+		}
+	}
+
+	return word;
+}
+
+int main()
+{
+	std::mt19937 rng(1);
+
+	std::vector<warp::lstring> dict;
+	warp::fuzzy<int> fz(3);
+
+	for (int i = 0; i < 20000; ++i) {
+		dict.push_back(random_word(rng));
+		fz.feed_word(dict.back(), i);
+	}
+	fz.freeze();
+
+	long matches = 0, filtered = 0, unfiltered = 0;
+
+	for (int q = 0; q < 500; ++q) {
+		warp::lstring text = random_edits(rng, dict[rng() % dict.size()], rng() % 4);
+		int max_distance = 1 + rng() % 2;
+
+		warp::search_budget fb, ub;
+		std::vector<int> fc = fz.search(text, max_distance, fb);
+		std::vector<int> uc = fz.search(text, -1, ub);
+
+		std::set<int> fset(fc.begin(), fc.end());
+		std::set<int> uset(uc.begin(), uc.end());
+
+		for (auto c = fset.begin(); c != fset.end(); ++c) {
+			if (!uset.count(*c)) {
+				std::cerr << "query " << q << ": filtered candidate " << *c << " shares no n-gram with the query" << std::endl;
+				return -1;
+			}
+		}
+
+		for (size_t i = 0; i < dict.size(); ++i) {
+			if (!uset.count(i) || warp::distance::levenstein<warp::lstring>(text, dict[i], max_distance) < 0)
+				continue;
+
+			if (!fset.count(i)) {
+				std::cerr << "query " << q << ": word " << i << " within " << max_distance <<
+					" edits has been dropped by prefix filtering" << std::endl;
+				return -1;
+			}
+
+			++matches;
+		}
+
+		filtered += fc.size();
+		unfiltered += uc.size();
+	}
+
+	std::cout << "matches: " << matches << ", candidates: filtered: " << filtered <<
+		", unfiltered: " << unfiltered << std::endl;
+	return 0;
+}
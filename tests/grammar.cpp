@@ -0,0 +1,145 @@
+#include "warp/grammar.hpp"
+
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace ioremap;
+
+/*
+ * grammar_matcher runs many grammars in one pass, it must return the same positions
+ * as the substring search it replaced, which is kept below as the reference.
+ * Grammars and token features are random, feature bits are taken from a small pool
+ * which spans every mask word, and long grammars spill into several matcher lanes.
+ */
+
+// the best matching entry of the token or empty entry if it does not have all requested features
+static warp::ef found(const warp::grammar &mask, const std::vector<warp::ef> &features)
+{
+	int request_max_count = warp::bits_set(mask.features);
+	int max_count = 0;
+
+	warp::ef max_ef;
+	for (auto fres = features.begin(); fres != features.end(); ++fres) {
+		if ((mask.negative & fres->features).any())
+			continue;
+
+		int count = warp::bits_set(mask.features & fres->features);
+
+		if (count > max_count) {
+			max_ef = *fres;
+			max_count = count;
+		}
+	}
+
+	if (max_count >= request_max_count)
+		return max_ef;
+
+	return warp::ef();
+}
+
+static std::vector<int> grammar_deduction(const std::vector<warp::grammar> &gfeat, const std::vector<warp::word_features> &wfeat)
+{
+	std::vector<int> gram_positions;
+
+	int gfeat_pos = 0;
+	auto gram_start = wfeat.begin();
+	for (auto it = wfeat.begin(); it != wfeat.end();) {
+		warp::ef eftmp = found(gfeat[gfeat_pos], it->fvec);
+
+		if (!eftmp.features.any()) {
+			// try next word if the first grammar entry doesn't match
+			if (gfeat_pos == 0) {
+				++it;
+				++gram_start;
+				continue;
+			}
+
+			gfeat_pos = 0;
+			++gram_start;
+			it = gram_start;
+			continue;
+		}
+
+		++gfeat_pos;
+
+		if (gfeat_pos != (int)gfeat.size()) {
+			++it;
+			continue;
+		}
+
+		// whole grammar has been found
+		gram_positions.push_back(gram_start - wfeat.begin());
+		gfeat_pos = 0;
+
+		++it;
+		gram_start = it;
+	}
+
+	return gram_positions;
+}
+
+static warp::parsed_word::feature_mask random_mask(std::mt19937 &rng, int max_bits)
+{
+	static const size_t pool[] = {0, 1, 2, 63, 64, 65, 100, warp::parsed_word::feature_mask::bits - 1};
+
+	warp::parsed_word::feature_mask ret;
+	for (int i = rng() % (max_bits + 1); i > 0; --i)
+		ret.set(pool[rng() % (sizeof(pool) / sizeof(pool[0]))] % warp::parsed_word::feature_mask::bits);
+	return ret;
+}
+
+int main()
+{
+	std::mt19937 rng(1);
+	long matches = 0;
+
+	for (int iter = 0; iter < 3000; ++iter) {
+		std::vector<warp::word_features> words;
+		for (int i = rng() % 64; i > 0; --i) {
+			std::vector<warp::ef> fvec(rng() % 4);
+			for (auto f = fvec.begin(); f != fvec.end(); ++f)
+				f->features = random_mask(rng, 4);
+
+			words.emplace_back("word", fvec);
+		}
+
+		std::vector<std::vector<warp::grammar>> grams;
+		warp::grammar_matcher matcher;
+
+		for (int g = 1 + rng() % 40; g > 0; --g) {
+			// mostly short grammars, some fill a whole lane
+			size_t size = (rng() % 64 == 0) ? (size_t)warp::grammar_matcher::max_grammar_size : 1 + rng() % 4;
+
+			std::vector<warp::grammar> gram(size);
+			for (auto e = gram.begin(); e != gram.end(); ++e) {
+				e->features = random_mask(rng, 2);
+				// negative features never intersect requested ones
+				if (rng() % 4 == 0) {
+					e->negative = random_mask(rng, 1);
+					if ((e->negative & e->features).any())
+						e->negative = warp::parsed_word::feature_mask();
+				}
+			}
+
+			grams.push_back(gram);
+			matcher.add(gram);
+		}
+
+		std::vector<std::vector<int>> res = matcher.match(words);
+
+		for (size_t g = 0; g < grams.size(); ++g) {
+			std::vector<int> ref = grammar_deduction(grams[g], words);
+			if (ref != res[g]) {
+				std::cerr << "iteration " << iter << ", grammar " << g << ": matcher found " << res[g].size() <<
+					" positions, substring search found " << ref.size() << std::endl;
+				return -1;
+			}
+
+			matches += ref.size();
+		}
+	}
+
+	std::cout << "matches: " << matches << std::endl;
+	return 0;
+}
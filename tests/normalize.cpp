@@ -0,0 +1,89 @@
+#include "warp/lex.hpp"
+#include "warp/pack.hpp"
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace ioremap;
+
+/*
+ * Streaming normalization must keep memory bounded on text without whitespace: every chunk
+ * handed to the callback is at most chunk_size bytes, it starts and ends at UTF-8 character
+ * boundaries and chunks put together give the original text back.
+ */
+
+int main()
+{
+	char tmpl[] = "/tmp/warp-test-normalize.XXXXXX";
+	if (!mkdtemp(tmpl)) {
+		std::cerr << "could not create temporary directory" << std::endl;
+		return -1;
+	}
+	std::string dict = std::string(tmpl) + "/dict";
+
+	{
+		warp::packer pack(dict, 1, 1024 * 1024, warp::packer::format_msgpack);
+
+		warp::parsed_word rec;
+		rec.lemma = "мама";
+		rec.word = "мама";
+		pack.zprocess(rec);
+
+		rec.word = "мамы";
+		rec.ending_len = 2;
+		pack.zprocess(rec);
+
+		if (pack.finish())
+			return -1;
+	}
+
+	warp::lex lex;
+	lex.load(3, std::vector<std::string>(1, dict + ".0"));
+
+	unlink((dict + ".0").c_str());
+	rmdir(tmpl);
+
+	// two-byte letters and an odd chunk size, so that most cuts fall in the middle of a letter
+	std::string text;
+	while (text.size() < 4 * 1024 * 1024)
+		text += "мамы";
+
+	warp::stream_options opt;
+	opt.chunk_size = 4097;
+	opt.thread_num = 4;
+
+	std::istringstream in(text);
+	size_t offset = 0;
+	int err = 0;
+
+	lex.normalize(in, [&] (const warp::analysis &an) {
+			if (err)
+				return;
+
+			if (an.text.empty() || an.text.size() > opt.chunk_size) {
+				std::cerr << "offset: " << offset << ": chunk size: " << an.text.size() <<
+					", must be in (0, " << opt.chunk_size << "]" << std::endl;
+				err = -1;
+			} else if (((unsigned char)an.text[0] & 0xc0) == 0x80) {
+				std::cerr << "offset: " << offset << ": chunk starts in the middle of a character" << std::endl;
+				err = -1;
+			} else if (text.compare(offset, an.text.size(), an.text)) {
+				std::cerr << "offset: " << offset << ": chunk differs from the text" << std::endl;
+				err = -1;
+			}
+
+			offset += an.text.size();
+		}, opt);
+
+	if (!err && offset != text.size()) {
+		std::cerr << "chunks hold " << offset << " bytes, text size: " << text.size() << std::endl;
+		err = -1;
+	}
+
+	return err;
+}
@@ -0,0 +1,136 @@
+#include "warp/pack.hpp"
+
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace ioremap;
+
+/*
+ * Records packed with a tiny memory limit are spilled into many sorted runs which finish() merges.
+ * Unpacked output must be the same as without spills: lemmas sorted, records of the same lemma
+ * in the order they were added. Every output format is checked with one and several output files.
+ */
+
+static bool same(const warp::parsed_word &a, const warp::parsed_word &b)
+{
+	return a.lemma == b.lemma && a.word == b.word && a.features == b.features && a.ending_len == b.ending_len;
+}
+
+static std::vector<warp::parsed_word> random_records(std::mt19937 &rng, size_t num)
+{
+	std::vector<warp::parsed_word> ret(num);
+
+	for (size_t i = 0; i < num; ++i) {
+		warp::parsed_word &rec = ret[i];
+
+		// lemmas are interleaved, word makes every record unique
+		rec.lemma = "lemma" + std::to_string(rng() % (num / 20));
+		rec.word = rec.lemma + "-" + std::to_string(i);
+		for (size_t w = 0; w < warp::parsed_word::feature_mask::words; ++w)
+			rec.features.w[w] = (uint64_t)rng() << 32 | rng();
+		rec.ending_len = rng() % 10;
+	}
+
+	return ret;
+}
+
+static std::vector<warp::parsed_word> unpack_all(const std::string &base, int output_num)
+{
+	std::vector<std::string> files;
+	for (int i = 0; i < output_num; ++i) {
+		std::string name = base + "." + std::to_string(i);
+		if (access(name.c_str(), F_OK) == 0)
+			files.push_back(name);
+	}
+
+	// single thread reads chunks in file order
+	std::vector<warp::parsed_word> ret;
+	warp::unpacker unpack(files, 1, [&] (int, const warp::parsed_word &rec) {
+			ret.push_back(rec);
+			return true;
+		});
+
+	for (auto f = files.begin(); f != files.end(); ++f)
+		unlink(f->c_str());
+
+	return ret;
+}
+
+static int check(const std::string &dir, const std::vector<warp::parsed_word> &records,
+		const std::vector<warp::parsed_word> &expected,
+		int output_num, size_t memory_limit, warp::packer::output_format format, bool compress)
+{
+	std::string base = dir + "/out";
+
+	{
+		warp::packer pack(base, output_num, memory_limit, format, compress);
+		for (auto rec = records.begin(); rec != records.end(); ++rec) {
+			if (!pack.zprocess(*rec)) {
+				std::cerr << "could not add record" << std::endl;
+				return -1;
+			}
+		}
+
+		int err = pack.finish();
+		if (err) {
+			std::cerr << "finish failed: " << err << std::endl;
+			return -1;
+		}
+	}
+
+	std::vector<warp::parsed_word> unpacked = unpack_all(base, output_num);
+
+	bool ok = unpacked.size() == expected.size();
+	for (size_t i = 0; ok && i < unpacked.size(); ++i)
+		ok = same(unpacked[i], expected[i]);
+
+	if (!ok) {
+		std::cerr << "output files: " << output_num << ", memory limit: " << memory_limit <<
+			", format: " << format << ", compress: " << compress <<
+			": unpacked records differ from packed ones" << std::endl;
+		return -1;
+	}
+
+	return 0;
+}
+
+int main()
+{
+	std::mt19937 rng(1);
+	std::vector<warp::parsed_word> records = random_records(rng, 20000);
+
+	std::vector<warp::parsed_word> expected = records;
+	std::stable_sort(expected.begin(), expected.end(), [] (const warp::parsed_word &a, const warp::parsed_word &b) {
+			return a.lemma < b.lemma;
+		});
+
+	char tmpl[] = "/tmp/warp-test-pack.XXXXXX";
+	if (!mkdtemp(tmpl)) {
+		std::cerr << "could not create temporary directory" << std::endl;
+		return -1;
+	}
+	std::string dir(tmpl);
+
+	int err = 0;
+
+	// the first limit keeps everything in memory, the second one spills every couple hundred records
+	const size_t limits[] = {1024 * 1024 * 1024, 32 * 1024};
+	const int outputs[] = {1, 3};
+
+	for (auto limit : limits) {
+		for (auto output_num : outputs) {
+			for (int format = warp::packer::format_msgpack; format <= warp::packer::format_columnar && !err; ++format) {
+				for (int compress = 0; compress < 2 && !err; ++compress)
+					err = check(dir, records, expected, output_num, limit, (warp::packer::output_format)format, compress);
+			}
+		}
+	}
+
+	rmdir(dir.c_str());
+	return err;
+}